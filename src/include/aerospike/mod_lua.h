@@ -24,6 +24,10 @@
 #include <lua.h>
 
 #include <aerospike/as_module.h>
+#include <aerospike/as_aerospike.h>
+#include <aerospike/as_list.h>
+#include <aerospike/as_rec.h>
+#include <aerospike/as_result.h>
 
 /**
  * Lua Module
@@ -37,3 +41,17 @@ extern as_module mod_lua;
 int mod_lua_rdlock(as_module * m);
 int mod_lua_wrlock(as_module * m);
 int mod_lua_unlock(as_module * m);
+
+
+/**
+ * Applies a record function to each record of a batch, leasing a single
+ * lua_State for the whole batch. The arguments are converted once and
+ * shared by every call, so list and map arguments are the same objects
+ * in each call.
+ *
+ * @param recs      the records to apply the function to.
+ * @param n         the number of records.
+ * @param results   n initialized results, populated with each call's result.
+ * @return 0 on success, otherwise the same error codes as apply_record.
+ */
+int mod_lua_apply_record_batch(as_module * m, as_aerospike * as, const char * filename, const char * function, as_rec ** recs, uint32_t n, as_list * args, as_result * results);
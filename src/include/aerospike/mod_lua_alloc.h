@@ -0,0 +1,52 @@
+/******************************************************************************
+ * Copyright 2008-2013 by Aerospike.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy 
+ * of this software and associated documentation files (the "Software"), to 
+ * deal in the Software without restriction, including without limitation the 
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or 
+ * sell copies of the Software, and to permit persons to whom the Software is 
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in 
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING 
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ *****************************************************************************/
+#pragma once
+
+#include <stdint.h>
+
+#include <lua.h>
+
+#include <aerospike/as_memtracker.h>
+
+/**
+ * Create a state whose memory comes from its own size-class slabs.
+ * Slabs and large blocks are reserved with the memtracker, if any, and
+ * allocations it refuses fail as out of memory. Shrinks never fail on
+ * a refusal, as Lua requires, and may take a slab the memtracker did not
+ * grant.
+ */
+lua_State * mod_lua_alloc_newstate(as_memtracker * mt);
+
+/**
+ * Close a state, and release its slabs.
+ */
+void mod_lua_alloc_close(lua_State * l);
+
+/**
+ * Release the state's empty slabs.
+ */
+void mod_lua_alloc_trim(lua_State * l);
+
+/**
+ * Bytes allocated by all states.
+ */
+uint64_t mod_lua_alloc_memory();
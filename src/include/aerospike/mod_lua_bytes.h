@@ -31,3 +31,9 @@ int mod_lua_bytes_register(lua_State *);
 as_bytes * mod_lua_pushbytes(lua_State *, as_bytes * );
 
 as_bytes * mod_lua_tobytes(lua_State *, int);
+
+/**
+ * The bytes at index, first copied into a buffer of their own if they
+ * are a view of other bytes, so they can be stored.
+ */
+as_bytes * mod_lua_ownbytes(lua_State *, int);
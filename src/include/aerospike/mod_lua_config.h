@@ -22,6 +22,7 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stdint.h>
 
 /*****************************************************************************
  * TYPES
@@ -33,6 +34,17 @@ typedef struct mod_lua_config_s mod_lua_config;
 struct mod_lua_config_s {
     bool    server_mode;
     bool    cache_enabled;
+    bool    thread_cache_enabled;   // per-thread lua_State cache in front of the shared cache
+    uint32_t batch_gc_interval;     // records between lua_gc steps in a batch apply, 0 for the default
+    bool    alloc_trim;             // collect and release a state's empty slabs after every call
+    bool    stats_enabled;          // per function call counts and phase latencies, see mod_lua_stats.h
+    uint32_t cache_state_min;       // states created per module on load, and the pool floor, 0 for the default
+    uint32_t cache_state_max;       // states cached per module at most, 0 for the default
+    uint32_t cache_idle_decay;      // seconds a cached state may stay unused before it is closed, 0 for the default
+    uint64_t cache_memory_max;      // bytes all cached states may hold together, 0 for no limit
+    uint32_t prewarm_threads;       // background threads creating states for (re)loaded modules, 0 for the default
+    uint32_t stream_workers;        // threads a stream apply partitions its input across, 0 or 1 to apply it on the caller
+    uint64_t aggregate_flush_bytes; // bytes an aggregate may hold before it is passed on to a reduce as a partial result, 0 for no limit
     char    system_path[256];
     char    user_path[256];
 };
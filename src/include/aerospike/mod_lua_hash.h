@@ -0,0 +1,41 @@
+/******************************************************************************
+ * Copyright 2008-2013 by Aerospike.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy 
+ * of this software and associated documentation files (the "Software"), to 
+ * deal in the Software without restriction, including without limitation the 
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or 
+ * sell copies of the Software, and to permit persons to whom the Software is 
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in 
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING 
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ *****************************************************************************/
+#pragma once
+
+#include <lua.h>
+
+#include <stddef.h>
+#include <stdint.h>
+
+int mod_lua_hash_register(lua_State *);
+
+/**
+ * CRC32C (Castagnoli) of len bytes of data, continuing from crc, which
+ * is 0 for the first block. Uses the SSE4.2 crc32 instruction when the
+ * CPU has it.
+ */
+uint32_t mod_lua_crc32c(uint32_t crc, const void * data, size_t len);
+
+/**
+ * A fast, non-cryptographic 64-bit hash of len bytes of data.
+ */
+uint64_t mod_lua_hash64(const void * data, size_t len, uint64_t seed);
@@ -26,7 +26,11 @@
 #include <lualib.h>
 #include <stdio.h>
 
-
+/**
+ * A Class's metatable holds, under this key, a copy of itself without
+ * __gc, for boxes the host frees, so Lua never has to finalize them.
+ */
+#define MOD_LUA_REG_HOST_METATABLE "__host"
 
 /**
  * Registers an Object
@@ -0,0 +1,126 @@
+/******************************************************************************
+ * Copyright 2008-2013 by Aerospike.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy 
+ * of this software and associated documentation files (the "Software"), to 
+ * deal in the Software without restriction, including without limitation the 
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or 
+ * sell copies of the Software, and to permit persons to whom the Software is 
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in 
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING 
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ *****************************************************************************/
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*****************************************************************************
+ * CONSTANTS
+ *****************************************************************************/
+
+#define MOD_LUA_STATS_NAME_MAX 128
+
+/**
+ * Latency buckets. Bucket 0 counts calls under 1us, and bucket i counts
+ * calls in [2^(i-1), 2^i) us. The last bucket also counts anything longer.
+ */
+#define MOD_LUA_STATS_BUCKETS 32
+
+/*****************************************************************************
+ * TYPES
+ *****************************************************************************/
+
+/**
+ * The phases of a UDF call.
+ */
+typedef enum mod_lua_stats_phase_e {
+    MOD_LUA_STATS_POLL = 0,     // leasing a state
+    MOD_LUA_STATS_ARGS,         // pushing the function and arguments
+    MOD_LUA_STATS_CALL,         // running the function
+    MOD_LUA_STATS_RESULT,       // converting the result
+    MOD_LUA_STATS_OFFER,        // returning the state
+    MOD_LUA_STATS_PHASES
+} mod_lua_stats_phase;
+
+/**
+ * State cache events.
+ */
+typedef enum mod_lua_stats_cache_event_e {
+    MOD_LUA_STATS_CACHE_HIT = 0,
+    MOD_LUA_STATS_CACHE_MISS,
+    MOD_LUA_STATS_CACHE_CREATE,
+    MOD_LUA_STATS_CACHE_CLOSE,
+    MOD_LUA_STATS_CACHE_EVENTS
+} mod_lua_stats_cache_event;
+
+struct mod_lua_stats_s;
+typedef struct mod_lua_stats_s mod_lua_stats;
+
+struct mod_lua_function_stats_s;
+typedef struct mod_lua_function_stats_s mod_lua_function_stats;
+
+struct mod_lua_cache_stats_s;
+typedef struct mod_lua_cache_stats_s mod_lua_cache_stats;
+
+/**
+ * Totals for a module function.
+ */
+struct mod_lua_function_stats_s {
+    char        module[MOD_LUA_STATS_NAME_MAX];
+    char        function[MOD_LUA_STATS_NAME_MAX];
+    uint64_t    calls;
+    uint64_t    errors;
+    uint64_t    latency[MOD_LUA_STATS_PHASES][MOD_LUA_STATS_BUCKETS];
+};
+
+/**
+ * Totals for the state cache.
+ */
+struct mod_lua_cache_stats_s {
+    uint64_t    events[MOD_LUA_STATS_CACHE_EVENTS];
+    uint64_t    memory;     // bytes allocated by all states
+};
+
+typedef bool (* mod_lua_stats_foreach_callback)(const mod_lua_function_stats * stats, void * udata);
+
+/*****************************************************************************
+ * FUNCTIONS
+ *****************************************************************************/
+
+/**
+ * The stats for a module function, created on first use.
+ * Returns NULL if no more functions can be tracked.
+ */
+mod_lua_stats * mod_lua_stats_get(const char * module, const char * function);
+
+void mod_lua_stats_call(mod_lua_stats * stats, bool error);
+
+void mod_lua_stats_latency(mod_lua_stats * stats, mod_lua_stats_phase phase, uint64_t ns);
+
+void mod_lua_stats_cache(mod_lua_stats_cache_event event);
+
+/**
+ * Monotonic time, in nanoseconds.
+ */
+uint64_t mod_lua_stats_now();
+
+/**
+ * Call the callback with the totals of every tracked function, until it
+ * returns false.
+ */
+void mod_lua_stats_foreach(mod_lua_stats_foreach_callback callback, void * udata);
+
+/**
+ * Populate the cache totals.
+ */
+void mod_lua_stats_cache_get(mod_lua_cache_stats * stats);
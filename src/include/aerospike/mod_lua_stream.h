@@ -21,6 +21,8 @@
  *****************************************************************************/
 #pragma once
 
+#include <stdint.h>
+
 #include <lua.h>
 #include <aerospike/as_stream.h>
 
@@ -29,3 +31,9 @@ int mod_lua_stream_register(lua_State *);
 as_stream * mod_lua_pushstream(lua_State *, as_stream *);
 
 as_stream * mod_lua_tostream(lua_State *, int);
+
+/**
+ * Sets the bytes an aggregate or reduce in stream.pipe() may hold before
+ * passing its value on as a partial result, 0 for no limit.
+ */
+void mod_lua_stream_flush_bytes(uint64_t);
@@ -21,6 +21,8 @@
  *****************************************************************************/
 #pragma once
 
+#include <stdbool.h>
+
 #include <lua.h>
 #include <lauxlib.h>
 #include <lualib.h>
@@ -43,9 +45,14 @@ as_val * mod_lua_takeval(lua_State * l, int i);
 as_val * mod_lua_retval(lua_State * l);
 as_val * mod_lua_toval(lua_State *, int);
 int mod_lua_pushval(lua_State *, const as_val *);
+int mod_lua_pushtable(lua_State *, const as_val *);
+
+as_val * mod_lua_double_new(double);
+bool mod_lua_double_get(const as_val *, double *);
 
 mod_lua_box * mod_lua_newbox(lua_State *, mod_lua_scope, void *, const char *);
 mod_lua_box * mod_lua_pushbox(lua_State *, mod_lua_scope, void *, const char *);
+mod_lua_box * mod_lua_sharebox(lua_State *, as_val *, const char *);
 mod_lua_box * mod_lua_tobox(lua_State *, int, const char *);
 mod_lua_box * mod_lua_checkbox(lua_State *, int, const char *);
 int mod_lua_freebox(lua_State *, int, const char *);
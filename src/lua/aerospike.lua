@@ -101,6 +101,8 @@ end
 --
 -- Apply function to a record and arguments.
 --
+-- The host sandboxes `f` with env_record() when it first resolves it.
+--
 -- @param f the fully-qualified name of the function.
 -- @param r the record to be applied to the function.
 -- @param ... additional arguments to be applied to the function.
@@ -111,13 +113,8 @@ function apply_record(f, r, ...)
     if f == nil then
         error("function not found", 2)
     end
-    
-    if not sandboxed[f] then
-        setfenv(f,env_record())
-        sandboxed[f] = true
-    end
 
-    success, result = pcall(f, r, ...)
+    local success, result = pcall(f, r, ...)
     if success then
         return result
     else
@@ -215,7 +212,7 @@ function apply_stream(f, scope, istream, ostream, ...)
 
     local stream_ops = StreamOps_create();
     
-    success, result = pcall(f, stream_ops, ...)
+    local success, result = pcall(f, stream_ops, ...)
 
     -- info("apply_stream: success=%s, result=%s", tostring(success), tostring(result))
 
@@ -223,19 +220,10 @@ function apply_stream(f, scope, istream, ostream, ...)
 
         local ops = StreamOps_select(result.ops, scope);
         
-        -- Apply server operations to the stream
-        -- result => a stream_ops object
-        local values = StreamOps_apply(stream_iterator(istream), ops);
-
-        -- Iterate the stream of values from the computation
-        -- then pipe it to the ostream
-        for value in values do
-            -- info("value = %s", tostring(value))
-            stream.write(ostream, value)
-        end
-
-        -- Write NIL to indicate the end of the stream
-        stream.write(ostream, nil)
+        -- Apply server operations to the stream, piping the values
+        -- from the computation, then NIL, to the ostream. The client
+        -- reduces the results of the server again.
+        stream.pipe(istream, ops, ostream, scope == 1)
 
         -- 0 is success
         return 0
@@ -245,3 +233,88 @@ function apply_stream(f, scope, istream, ostream, ...)
     end
 end
 
+--
+-- Selects the server ops built by the function, and splits them at the
+-- first reduce: the ops up to and including the reduce can be applied to
+-- each partition of a stream, then the ops from the reduce on merge the
+-- partial results. Returns nil when there is no reduce to split at, or an
+-- op before it, like limit, would change the result.
+--
+local function stream_ops_split(f, ...)
+
+    if f == nil then
+        error("function not found", 2)
+    end
+
+    require("stream_ops")
+
+    if not sandboxed[f] then
+        setfenv(f,env_record())
+        sandboxed[f] = true
+    end
+
+    local stream_ops = StreamOps_create();
+
+    local success, result = pcall(f, stream_ops, ...)
+
+    if not success then
+        error(result, 2)
+    end
+
+    local ops = StreamOps_select(result.ops, 1);
+
+    -- only ops that see each value on its own can precede the split
+    for i, op in ipairs(ops) do
+        if op.name == "reduce" then
+            return { unpack(ops, 1, i) }, { unpack(ops, i) }
+        elseif op.name ~= "filter" and op.name ~= "map" and op.name ~= "aggregate" then
+            return nil
+        end
+    end
+
+    return nil
+end
+
+--
+-- Tests whether apply_stream can partition the stream for the function.
+--
+-- @param f the fully-qualified name of the function.
+-- @param ... additional arguments to be applied to the function.
+-- @return true if the server ops of the function end in a reduce.
+--
+function apply_stream_split(f, ...)
+    return stream_ops_split(f, ...) ~= nil
+end
+
+--
+-- Apply the server ops of the function, up to and including the first
+-- reduce, to a partition of the stream.
+--
+-- @param f the fully-qualified name of the function.
+-- @param istream the partition of the stream.
+-- @param ostream receives the partial result.
+-- @param ... additional arguments to be applied to the function.
+-- @return 0 on success, otherwise failure.
+--
+function apply_stream_partial(f, istream, ostream, ...)
+    local partial = stream_ops_split(f, ...)
+    stream.pipe(istream, partial, ostream, true)
+    return 0
+end
+
+--
+-- Apply the server ops of the function, from the first reduce on, to the
+-- partial results of the partitions of the stream.
+--
+-- @param f the fully-qualified name of the function.
+-- @param istream the partial results.
+-- @param ostream receives the result.
+-- @param ... additional arguments to be applied to the function.
+-- @return 0 on success, otherwise failure.
+--
+function apply_stream_merge(f, istream, ostream, ...)
+    local partial, merge = stream_ops_split(f, ...)
+    stream.pipe(istream, merge, ostream, true)
+    return 0
+end
+
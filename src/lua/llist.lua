@@ -1315,6 +1315,25 @@ end -- objectCompare()
 --   (4) Looking for value 5:  (SV=5, Obj=x)
 --       : 5 < 10, Want Child A
 
+-- ======================================================================
+-- searchField(): How list.bsearch() finds the key of an object.
+-- ======================================================================
+-- Atomic objects are their own key, and complex objects without a key
+-- function have a "key" field.  Return the field (nil for atomic objects)
+-- and true, or false when the key needs the key function, which only Lua
+-- can call.
+-- ======================================================================
+local function searchField( ldtMap )
+  if ldtMap[R_KeyType] == KT_ATOMIC then
+    return nil, true;
+  end
+  local keyFunction = ldtMap[R_KeyFunction];
+  if keyFunction ~= nil and functionTable[keyFunction] ~= nil then
+    return nil, false;
+  end
+  return "key", true;
+end -- searchField()
+
 -- ======================================================================
 -- searchKeyList(): Search the Key list in a Root or Inner Node
 -- ======================================================================
@@ -1334,8 +1353,18 @@ local function searchKeyList( ldtMap, keyList, searchKey )
 
   local keyType = ldtMap[R_KeyType];
 
-  -- Linear scan of the KeyList.  Find the appropriate entry and return
-  -- the index.  Binary Search will come later.
+  -- Binary search of the KeyList, in C.  Keys are atomic, so it can
+  -- compare them, unless they are not numbers or strings.
+  local position, found = list.bsearch( keyList, searchKey );
+  if position ~= nil then
+    if found then
+      return position + 1; -- Right Child Pointer
+    end
+    return position; -- Left Child Pointer
+  end
+
+  -- Linear scan of the KeyList, for keys list.bsearch() can't compare.
+  -- Find the appropriate entry and return the index.
   local resultIndex = 0;
   local compareResult = 0;
   -- Do the List page mode search here
@@ -1405,13 +1434,27 @@ local function searchObjectList( ldtMap, objectList, searchKey )
   resultMap.Position = 0;
   resultMap.Status = ERR_OK;
 
-  -- Linear scan of the ObjectList.  Find the appropriate entry and return
-  -- the index.  Binary Search will come later.
+  -- Binary search of the ObjectList, in C, unless the object keys need
+  -- the key function.
+  local keyField, native = searchField( ldtMap );
+  if native then
+    local position, found = list.bsearch( objectList, searchKey, keyField );
+    if position ~= nil then
+      resultMap.Position = position;
+      resultMap.Found = found;
+      GP=F and trace("[EXIT]<%s:%s>ResultMap(%s)",
+        MOD, meth, tostring(resultMap));
+      return resultMap;
+    end
+  end
+
+  -- Linear scan of the ObjectList, for keys list.bsearch() can't compare.
+  -- Find the appropriate entry and return the index.
   local resultIndex = 0;
   local compareResult = 0;
   local objectKey;
   -- Do the List page mode search here
-  local listSize = list.size( keyList );
+  local listSize = list.size( objectList );
   for i = 1, listSize, 1 do
     compareResult = objectCompare( ldtMap, searchKey, objectList[i] );
     if compareResult == CR_ERROR then
@@ -1744,13 +1787,15 @@ end -- treeSearch()
 
 -- ======================================================================
 -- Populate this leaf after a leaf split.
+-- Copy the objects of the split leaf from splitPosition to the end into
+-- the new leaf, with list.slice().
 -- ======================================================================
-local function populateLeaf( newLeafSubRec, keyList, splitPosition )
+local function populateLeaf( newLeafSubRec, objectList, splitPosition )
   local meth = "populateLeaf()";
   local rc = 0;
   GP=F and trace("[ENTER]<%s:%s> ", MOD, meth );
 
-  warn("[WARNING]<%s:%s> Function Not yet Implemented", MOD, meth );
+  newLeafSubRec[LSR_LIST_BIN] = list.slice( objectList, splitPosition );
 
   GP=F and trace("[EXIT]<%s:%s> rc(%d)", MOD, meth, rc );
   return rc;
@@ -1760,24 +1805,15 @@ end -- populateLeaf()
 -- listInsert()
 -- General List Insert function that can be used to insert
 -- keys, digests or objects.
+-- list.insert() moves the values from "Position" to the end up one, and
+-- appends when "Position" is past the end.
 -- ======================================================================
 local function listInsert( myList, newValue, position )
   local meth = "listInsert()";
   rc = 0;
   GP=F and trace("[ENTER]<%s:%s> ", MOD, meth );
-  
-  local listSize = list.size( myList );
-  if( position > listSize ) then
-    -- Just append to the list
-    list.append( myList, newValue );
-  else
-    -- Move elements in the list from "Position" to the end (end + 1)
-    -- and then insert the new value at "Position"
-    for i = listSize, position, -1  do
-      myList[i+1] = myList[i];
-    end -- for()
-    myList[position] = newValue;
-  end
+
+  list.insert( myList, position, newValue );
 
   GP=F and trace("[EXIT]<%s:%s> rc(%d)", MOD, meth, rc );
   return rc;
@@ -1902,7 +1938,13 @@ local function resetLeafAfterSplit( topRec, leafSubRec, splitPosition )
   local meth = "resetLeafAfterSplit()";
   local rc = 0;
   GP=F and trace("[ENTER]<%s:%s> ", MOD, meth );
-  warn("[WARNING]<%s:%s> Function Not Complete", MOD, meth );
+
+  -- list.split() leaves the objects before splitPosition in the list, and
+  -- returns the rest, which populateLeaf() already copied.
+  local objectList = leafSubRec[LSR_LIST_BIN];
+  list.split( objectList, splitPosition );
+  leafSubRec[LSR_LIST_BIN] = objectList;
+  aerospike:update_subrec( leafSubRec );
 
   GP=F and trace("[EXIT]<%s:%s> rc(%d)", MOD, meth, rc );
   return rc;
@@ -1976,7 +2018,7 @@ local function splitLeafInsert( topRec, searchPath, ldtMap, newKey, newValue )
   -- the value at splitPosition up to the parent node.
   local newLeafSubRec = createLeaf( topRec );
   local newLeafSubRecDigest = record.digest( newSubRec );
-  populateLeaf( newLeafSubRec, ldtMap[R_RootKeyList], splitPosition );
+  populateLeaf( newLeafSubRec, leafSubRec[LSR_LIST_BIN], splitPosition );
 
   -- Propagate the split value up to the parent (recursively).
   insertParentNode(topRec,searchPath,ldtMap,newValue,newLeafSubRec,leafLevel);
@@ -86,6 +86,12 @@ local SS_REGULAR ='R'; -- Using "Regular Storage" (regular) mode
 local KT_ATOMIC  ='A'; -- the set value is just atomic (number or string)
 local KT_COMPLEX ='C'; -- the set value is complex. Use Function to get key.
 
+-- HashType: the hash that picks the bin of a value.  Sets created before
+-- HashType was recorded have none, and keep using CRC32 so their values
+-- stay in the same bins.
+local HT_CRC32   ='C'; -- the CRC32.Hash() of the value, as a string
+local HT_HASH64  ='H'; -- hash.hash64() of the value
+
 -- Key Compare Function for Complex Objects
 -- By default, a complex object will have a "KEY" field, which the
 -- key_compare() function will use to compare.  If the user passes in
@@ -119,7 +125,6 @@ local PackageDebugModeBinary = "DebugModeBinary";
 local PackageDebugModeNumber = "DebugModeNumber";
 
 -- set up our "outside" links
-local  CRC32 = require('CRC32');
 local functionTable = require('UdfFunctionTable');
 
 -- ||||||||||||||||||||||||||||||||||||||||||||||||||||||||||||||||||||||
@@ -356,6 +361,11 @@ local function adjustLSetMap( lsetCtrlMap, argListMap )
       if value > 0 and value < MODULO_MAX then
         lsetCtrlMap.Modulo = value;
       end
+    elseif name == "HashType"  and type( value ) == "string" then
+      -- Verify it's a valid value
+      if value == HT_CRC32 or value == HT_HASH64 then
+        lsetCtrlMap.HashType = value;
+      end
     end
   end -- for each argument
 
@@ -407,6 +417,7 @@ local function initializeLSetMap(topRec, lsetBinName )
   lsetCtrlMap.ItemCount = 0;   -- Count of valid elements
   lsetCtrlMap.TotalCount = 0;  -- Count of both valid and deleted elements
   lsetCtrlMap.Modulo = DEFAULT_DISTRIB;
+  lsetCtrlMap.HashType = HT_HASH64; -- Hash used to pick the bin
   lsetCtrlMap.ThreshHold = 101; -- Rehash after this many have been inserted
 
   GP=F and trace("[ENTER]: <%s:%s>:: lsetCtrlMap(%s)",
@@ -432,6 +443,7 @@ local function lsetSummary( lsetMap )
   resultMap.ItemCount            = lsetMap.ItemCount;
   resultMap.TotalCount           = lsetMap.TotalCount;
   resultMap.Modulo               = lsetMap.Modulo;
+  resultMap.HashType             = lsetMap.HashType;
   resultMap.ThreshHold           = lsetMap.ThreshHold;
   resultMap.StoreMode            = lsetMap.StoreMode;
   resultMap.StoreState           = lsetMap.StoreState;
@@ -456,18 +468,20 @@ local function lsetSummaryString( lsetMap )
 end -- lsetSummaryString()
 
 -- ======================================================================
--- We use the "CRC32" package for hashing the value in order to distribute
--- the value to the appropriate "sub lists".
--- ======================================================================
--- local  CRC32 = require('CRC32'); Do this above, in the "global" area
+-- We use the C "hash" module for hashing the value in order to distribute
+-- the value to the appropriate "sub lists".  hash.crc32() is the same
+-- hash as CRC32.Hash(), for sets without a HashType.
 -- ======================================================================
 -- Return the hash of "value", with modulo.
 -- Notice that we can use ZERO, because this is not an array index
 -- (which would be ONE-based for Lua) but is just used as a name.
 -- ======================================================================
-local function stringHash( value, modulo )
+local function stringHash( value, modulo, hashType )
   if value ~= nil and type(value) == "string" then
-    return CRC32.Hash( value ) % modulo;
+    if hashType == HT_HASH64 then
+      return hash.hash64( value, modulo );
+    end
+    return hash.crc32( value, modulo );
   else
     return 0;
   end
@@ -477,14 +491,16 @@ end -- stringHash
 -- Return the hash of "value", with modulo
 -- Notice that we can use ZERO, because this is not an array index
 -- (which would be ONE-based for Lua) but is just used as a name.
--- NOTE: Use a better Hash Function.
 -- ======================================================================
-local function numberHash( value, modulo )
+local function numberHash( value, modulo, hashType )
   local meth = "numberHash()";
   local result = 0;
   if value ~= nil and type(value) == "number" then
-    -- math.randomseed( value ); return math.random( modulo );
-    result = CRC32.Hash( value ) % modulo;
+    if hashType == HT_HASH64 then
+      result = hash.hash64( value, modulo );
+    else
+      result = hash.crc32( value, modulo );
+    end
   end
   GP=F and trace("[EXIT]:<%s:%s>HashResult(%s)", MOD, meth, tostring(result))
   return result
@@ -540,9 +556,9 @@ local function computeSetBin( newValue, lsetCtrlMap )
     return 0
   else
     if type(newValue) == "number" then
-      binNumber  = numberHash( newValue, lsetCtrlMap.Modulo );
+      binNumber  = numberHash( newValue, lsetCtrlMap.Modulo, lsetCtrlMap.HashType );
     elseif type(newValue) == "string" then
-      binNumber  = stringHash( newValue, lsetCtrlMap.Modulo );
+      binNumber  = stringHash( newValue, lsetCtrlMap.Modulo, lsetCtrlMap.HashType );
     elseif type(newValue) == "userdata" then
       -- We are assuming that the user has supplied a function for us to
       -- deal with a complex object.  If no function, then error.
@@ -554,7 +570,7 @@ local function computeSetBin( newValue, lsetCtrlMap )
 
       print("MUST REGISTER A HASH FUNCTION FOR COMPLEX TYPES!!");
 
-      binNumber  = stringHash( newValue.KEY, lsetCtrlMap.Modulo );
+      binNumber  = stringHash( newValue.KEY, lsetCtrlMap.Modulo, lsetCtrlMap.HashType );
     else -- error case
       warn("[ERROR]<%s:%s>Unexpected Type (should be number, string or map)",
            MOD, meth );
@@ -1407,18 +1407,22 @@ local function readByteArray( resultList, lsoList, ldrChunk, count,
   --                            A
   -- To Read:  Start Here ------+  (at the beginning of the LAST entry)
   --           and move BACK towards the front.
+  -- bytes.split_fixed() copies the last "numToRead" entries out in one
+  -- call, last entry first.  It reads a view of the first "listSize"
+  -- entries, so the last entry is found from the control count, not from
+  -- the size of the byte array.
   local readValue;
   local byteValue;
-  local byteIndex = 0; -- our direct position in the byte array.
   GP=F and trace("[DEBUG]:<%s:%s>Starting loop Byte Array(%s) ListSize(%d)",
       MOD, meth, tostring(byteArray), listSize );
-  for i = (listSize - 1), 0, -1 do
+  local entryView = bytes.view( byteArray, 1, listSize * entrySize );
+  local entryList = bytes.split_fixed( entryView, entrySize, numToRead, true );
+  for i = 1, list.size( entryList ), 1 do
 
-    byteIndex = 1 + (i * entrySize);
-    byteValue = bytes.get_bytes( byteArray, byteIndex, entrySize );
+    byteValue = entryList[i];
 
---  GP=F and trace("[DEBUG]:<%s:%s>: In Loop: i(%d) BI(%d) BV(%s)",
---    MOD, meth, i, byteIndex, tostring( byteValue ));
+--  GP=F and trace("[DEBUG]:<%s:%s>: In Loop: i(%d) BV(%s)",
+--    MOD, meth, i, tostring( byteValue ));
 
     -- Apply the UDF to the item, if present, and if result NOT NULL, then
     if doUnTransform == true then -- apply the "UnTransform" function
@@ -1662,25 +1666,28 @@ local function ldrInsertBytes( ldrChunkRec, lsoMap, listIndex, insertList )
   GP=F and trace("[DEBUG]: <%s:%s> TotalItems(%d) SpaceAvail(%d) ByteStart(%d)",
     MOD, meth, totalItemsToWrite, itemSlotsAvailable, chunkByteStart );
 
-  local byteIndex;
-  local insertItem;
-  for i = 0, (newItemsStored - 1), 1 do
-    byteIndex = chunkByteStart + (i * entrySize);
-    insertItem = insertList[i+listIndex];
-
-    GP=F and
-    trace("[DEBUG]:<%s:%s>ByteAppend:Array(%s) Entry(%d) Val(%s) Index(%d)",
-      MOD, meth, tostring( chunkByteArray), i, tostring( insertItem ),
-      byteIndex );
+  -- bytes.append_fixed() packs the entries in one call, at the end of the
+  -- byte array, so that must be where the entries in the chunk end.
+  if bytes.size( chunkByteArray ) ~= chunkByteStart - 1 then
+    warn("[ERROR]: <%s:%s> Byte Array Size(%d) does not match ByteStart(%d)",
+      MOD, meth, bytes.size( chunkByteArray ), chunkByteStart );
+    return -1;
+  end
 
-    bytes.put_bytes( chunkByteArray, byteIndex, insertItem );
+  local itemsAppended = bytes.append_fixed( chunkByteArray, insertList,
+    entrySize, listIndex, newItemsStored );
+  if itemsAppended == nil then
+    warn("[ERROR]: <%s:%s> Byte Append Failed: ByteArray(%s)",
+      MOD, meth, tostring( chunkByteArray ));
+    return -1;
+  end
 
-    GP=F and trace("[DEBUG]: <%s:%s> Post Append: ByteArray(%s)",
-      MOD, meth, tostring(chunkByteArray));
-  end -- for each remaining entry
+  GP=F and trace("[DEBUG]: <%s:%s> Post Append: ByteArray(%s)",
+    MOD, meth, tostring(chunkByteArray));
 
-  -- Update the ctrl map with the new count
-  ldrMap[LDR_ByteEntryCount] = entryCount + newItemsStored;
+  -- Update the ctrl map with the count actually appended, which stops
+  -- short at an item that is not bytes.
+  ldrMap[LDR_ByteEntryCount] = entryCount + itemsAppended;
 
   GP=F and trace("[DEBUG]: <%s:%s>: Post Chunk Copy: Ctrl(%s) List(%s)",
     MOD, meth, tostring(ldrMap), tostring( chunkByteArray ));
@@ -1689,6 +1696,12 @@ local function ldrInsertBytes( ldrChunkRec, lsoMap, listIndex, insertList )
   ldrChunkRec[LDR_CTRL_BIN] = ldrMap;
   ldrChunkRec[LDR_BNRY_BIN] = chunkByteArray;
 
+  if itemsAppended ~= newItemsStored then
+    warn("[ERROR]: <%s:%s> Appended(%d) of (%d): Item is not bytes",
+      MOD, meth, itemsAppended, newItemsStored );
+    return -1;
+  end
+
   GP=F and trace("[EXIT]: <%s:%s> newItemsStored(%d) List(%s) ",
     MOD, meth, newItemsStored, tostring( chunkByteArray ));
   return newItemsStored;
@@ -1,9 +1,5 @@
 require('as')
 
-local function check_limit(v)
-    return type(v) == 'number' and v >= 1000
-end
-
 --
 -- clone a table. creates a shallow copy of the table.
 --
@@ -151,15 +147,10 @@ function aggregate( next, init, f )
         -- get the initial value
         local a = clone(init)
         
-        -- get each subsequent value and aggregate them
+        -- get each subsequent value and aggregate them. stream.pipe()
+        -- passes partial values on once they reach a size limit.
         for b in next do
             a = f(a,b)
-
-            -- check the size limit, if it is exceeded,
-            -- then return the value
-            if check_limit(a) then
-                return a
-            end
         end
 
         -- we are done!
@@ -172,14 +163,28 @@ end
 --
 -- as_stream iterator
 --
+-- Values are read in batches of STREAM_BATCH_SIZE, to make fewer calls
+-- into the stream.
+--
+local STREAM_BATCH_SIZE = 256
+
 function stream_iterator(s)
     local done = false
+    local values = {}
+    local i = 1
+    local n = 0
     return function()
-        if done then return nil end
-        local v = stream.read(s)
-        if v == nil then
-            done = true
+        if i > n then
+            if done then return nil end
+            values, n = stream.read_batch(s, STREAM_BATCH_SIZE, values)
+            i = 1
+            if n < STREAM_BATCH_SIZE then
+                done = true
+            end
+            if n == 0 then return nil end
         end
+        local v = values[i]
+        i = i + 1
         return v;
     end
 end
@@ -232,6 +237,11 @@ function StreamOps_apply(stream, ops, i, n)
     -- get the current operation
     local op = ops[i]
 
+    -- operations without a func are only applied by stream.pipe()
+    if op.func == nil then
+        error("stream operation " .. op.name .. " requires stream.pipe()", 2)
+    end
+
     -- apply the operation and get a stream or use provided stream
     local s = op.func(stream, unpack(op.args)) or stream
 
@@ -307,6 +317,60 @@ function StreamOps:filter(...)
     return self
 end
 
+-- The following ops are applied in C by stream.pipe(). Those with the
+-- SCOPE_BOTH scope bound the values the server sends, then apply again on
+-- the client to merge the values from each server.
+
+-- stream : limit(n)
+--
+-- Passes the first n values, then ends the stream, so no more are read.
+--
+function StreamOps:limit(n)
+    table.insert(self.ops, { scope = SCOPE_BOTH, name = "limit", args = {n}})
+    return self
+end
+
+-- stream : topk(n, f)
+--
+-- Passes the n values with the largest keys, largest first. The key of a
+-- value is `f(value)`, or the value itself when `f` is not given.
+--
+function StreamOps:topk(n, f)
+    table.insert(self.ops, { scope = SCOPE_BOTH, name = "topk", args = {n, f}})
+    return self
+end
+
+-- stream : distinct()
+--
+-- Passes the first of each set of equal values. Lists and maps are equal
+-- when their string forms are.
+--
+function StreamOps:distinct()
+    table.insert(self.ops, { scope = SCOPE_BOTH, name = "distinct", args = {}})
+    return self
+end
+
+-- stream : sample(rate)
+--
+-- Passes each value with the probability `rate`.
+--
+function StreamOps:sample(rate)
+    table.insert(self.ops, { scope = SCOPE_EITHER, name = "sample", args = {rate}})
+    return self
+end
+
+-- stream : count_distinct()
+--
+-- Estimates the number of distinct values, with a HyperLogLog sketch.
+-- Each server sends its sketch, and the client merges them.
+--
+function StreamOps:count_distinct()
+    table.insert(self.ops, { scope = SCOPE_SERVER, name = "count_distinct", args = {}})
+    table.insert(self.ops, { scope = SCOPE_BOTH, name = "count_distinct_merge", args = {}})
+    table.insert(self.ops, { scope = SCOPE_CLIENT, name = "count_distinct_estimate", args = {}})
+    return self
+end
+
 -- stream : group(f)
 --
 -- Group By will return a Map of keys to a list of values. The key is determined by applying the 
@@ -316,22 +380,19 @@ function StreamOps:groupby(f)
 
     local function _aggregate(m, v)
         local k = f and f(v) or nil;
-        local l = m[k] or list()
+        local l = m[k]
+        if l == nil then
+            l = list()
+            m[k] = l
+        end
         list.append(l, v)
-        m[k] = l;
         return m;
     end
 
-    local function _merge(l1, l2)
-        local l = list.clone(l1)
-        for v in list.iterator(l2) do
-            list.append(l, v)
-        end
-        return l
-    end
-
-    function _reduce(m1, m2)
-        return map.merge(m1, m2, _merge)
+    -- the accumulated maps and lists are not shared, so they are merged
+    -- in place, rather than copied at each step
+    local function _reduce(m1, m2)
+        return map.merge_into(m1, m2, list.concat)
     end
 
     return self : aggregate(map(), _aggregate) : reduce(_reduce)
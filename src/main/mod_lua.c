@@ -25,6 +25,8 @@
 #include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
 #include <setjmp.h>         // needed for gracefully handling lua panics
 
 // #include <fault.h>
@@ -40,17 +42,22 @@
 #include <citrusleaf/cf_alloc.h>
 
 #include <aerospike/as_aerospike.h>
+#include <aerospike/as_arraylist.h>
 #include <aerospike/as_types.h>
 
 #include <aerospike/mod_lua.h>
 #include <aerospike/mod_lua_config.h>
 #include <aerospike/mod_lua_aerospike.h>
+#include <aerospike/mod_lua_alloc.h>
 #include <aerospike/mod_lua_record.h>
+#include <aerospike/mod_lua_stats.h>
 #include <aerospike/mod_lua_iterator.h>
 #include <aerospike/mod_lua_stream.h>
+#include <aerospike/mod_lua_string.h>
 #include <aerospike/mod_lua_list.h>
 #include <aerospike/mod_lua_map.h>
 #include <aerospike/mod_lua_bytes.h>
+#include <aerospike/mod_lua_hash.h>
 #include <aerospike/mod_lua_val.h>
 
 #include "internal.h"
@@ -63,11 +70,38 @@ pthread_rwlock_t g_cache_lock = PTHREAD_RWLOCK_INITIALIZER;
  * MACROS
  ******************************************************************************/
 
-#define CACHE_TABLE_ENTRY_MAX 128
+#define CACHE_TABLE_ENTRY_MAX 1024
 #define CACHE_ENTRY_KEY_MAX 128
 #define CACHE_ENTRY_GEN_MAX 128
 #define CACHE_ENTRY_STATE_MAX 128
 #define CACHE_ENTRY_STATE_MIN 10
+#define CACHE_ENTRY_IDLE_DECAY 60
+
+#define PREWARM_THREADS 2
+
+#define THREAD_CACHE_ENTRY_MAX 4
+#define THREAD_CACHE_STATE_MAX 2
+
+#define BATCH_GC_INTERVAL 64
+
+#define STREAM_WORKERS_MAX 64
+#define STREAM_WORKER_CHUNK 64
+
+#define STATE_FUNCTION_MAX 8
+#define STATE_FUNCTION_NAME_MAX 128
+
+/**
+ * Trace logging. Building with MOD_LUA_TRACE_DISABLED (make TRACE=0)
+ * compiles the sites out. Otherwise each site is one branch on
+ * trace_enabled, which trace_refresh() caches from the logger's level.
+ */
+#ifdef MOD_LUA_TRACE_DISABLED
+#define TRACE(__fmt, __args...) \
+    do { if ( 0 ) as_logger_trace(mod_lua.logger, __fmt, ##__args); } while ( 0 )
+#else
+#define TRACE(__fmt, __args...) \
+    do { if ( __builtin_expect(trace_enabled, 0) ) as_logger_trace(mod_lua.logger, __fmt, ##__args); } while ( 0 )
+#endif
 
 #define MOD_LUA_CONFIG_SYSPATH "/opt/aerospike/sys/udf/lua"
 #define MOD_LUA_CONFIG_USRPATH "/opt/aerospike/usr/udf/lua"
@@ -85,27 +119,184 @@ typedef struct cache_item_s cache_item;
 struct cache_entry_s {
     char            key[CACHE_ENTRY_KEY_MAX];
     char            gen[CACHE_ENTRY_GEN_MAX];
-    uint32_t        max_cache_size;
+    cf_atomic32     max_cache_size;
     cf_queue      * lua_state_q;
     cf_atomic32     cache_miss;
-    cf_atomic32     total;
+    cf_atomic32     low_water;      // fewest states queued since the last sweep
+    cf_atomic32     version;        // taken from cache_version when (re)initialized, 0 once removed
 };
 
 struct cache_item_s {
     char            key[CACHE_ENTRY_KEY_MAX];
     char            gen[CACHE_ENTRY_GEN_MAX];
+    uint32_t        version;        // version of centry the state was created for
+    cache_entry *   centry;         // reserved while the state is leased, NULL if there is no entry
     lua_State *     state;
 };
 
+struct prewarm_job_s;
+typedef struct prewarm_job_s prewarm_job;
+
+struct prewarm_job_s {
+    cache_entry *   centry;         // reserved for the job
+    uint32_t        version;        // the entry version to prewarm
+};
+
+struct thread_cache_entry_s;
+typedef struct thread_cache_entry_s thread_cache_entry;
+
+struct thread_cache_s;
+typedef struct thread_cache_s thread_cache;
+
+/**
+ * A thread's private stack of warm lua_States for a single module.
+ * The version is the version of the cache entry when the states were
+ * stored, so states of a since reloaded module can be discarded.
+ */
+struct thread_cache_entry_s {
+    char            key[CACHE_ENTRY_KEY_MAX];
+    char            gen[CACHE_ENTRY_GEN_MAX];
+    cache_entry *   centry;         // reserved while any state is stored
+    uint32_t        version;
+    uint32_t        size;
+    lua_State *     states[THREAD_CACHE_STATE_MAX];
+};
+
+/**
+ * The lock is only contended when a module is reinitialized or removed,
+ * and its states are drained from every thread's cache.
+ */
+struct thread_cache_s {
+    pthread_mutex_t     lock;
+    thread_cache *      prev;
+    thread_cache *      next;
+    thread_cache_entry  entries[THREAD_CACHE_ENTRY_MAX];
+};
+
+struct state_function_s;
+typedef struct state_function_s state_function;
+
+struct state_refs_s;
+typedef struct state_refs_s state_refs;
+
+struct state_function_s {
+    char            name[STATE_FUNCTION_NAME_MAX];
+    int             ref;
+};
+
+/**
+ * Per lua_State references, resolved once when the state is created
+ * or when a function is first called, so each apply only does a few
+ * registry reads. Lives in the state's registry as userdata.
+ */
+struct state_refs_s {
+    mod_lua_box *   aerospike;      // box bound to the "aerospike" global, reused in place
+    int             aerospike_ref;  // keeps the box alive if the global is reassigned
+    int             apply_record;   // apply_record() dispatcher
+    int             apply_stream;   // apply_stream() dispatcher
+    int             apply_stream_split;     // apply_stream_split(), tests whether a stream apply can be partitioned
+    int             apply_stream_partial;   // apply_stream_partial() dispatcher, for a partition
+    int             apply_stream_merge;     // apply_stream_merge() dispatcher, for the partial results
+    int             handle_error;   // error handler for apply_stream
+    uint32_t        nfunctions;
+    state_function  functions[STATE_FUNCTION_MAX];
+};
+
+struct bytecode_s;
+typedef struct bytecode_s bytecode;
+
+struct bytecode_buffer_s;
+typedef struct bytecode_buffer_s bytecode_buffer;
+
+/**
+ * A module precompiled by lua_dump(). Reference counted, and owned
+ * by bytecode_hash.
+ */
+struct bytecode_s {
+    char            name[CACHE_ENTRY_KEY_MAX];
+    size_t          size;
+    char            data[];
+};
+
+struct bytecode_buffer_s {
+    char *          data;
+    size_t          size;
+    size_t          capacity;
+};
+
 
 struct context_s;
 typedef struct context_s context;
 
+struct stats_timer_s;
+typedef struct stats_timer_s stats_timer;
+
+/**
+ * Times the phases of a call, when stats are enabled.
+ */
+struct stats_timer_s {
+    mod_lua_stats * stats;
+    uint64_t        mark;
+};
+
 struct context_s {
     mod_lua_config      config;
     pthread_rwlock_t *  lock;
 };
 
+struct stream_job_s;
+typedef struct stream_job_s stream_job;
+
+struct stream_worker_s;
+typedef struct stream_worker_s stream_worker;
+
+struct stream_merge_s;
+typedef struct stream_merge_s stream_merge;
+
+/**
+ * A stream apply partitioned across workers. The workers read the input
+ * under the lock, and the last one to finish signals done.
+ */
+struct stream_job_s {
+    context *       ctx;
+    as_aerospike *  as;
+    const char *    filename;
+    const char *    function;
+    as_list *       args;
+    as_stream *     istream;
+    bool            end;            // istream is exhausted
+    int             rc;             // error of the first worker that failed to apply the function, 0 if none
+    uint32_t        running;
+    pthread_mutex_t lock;
+    pthread_cond_t  done;
+};
+
+/**
+ * A worker's partition of a stream_job: istream reads chunks of the job's
+ * input, and ostream appends to the worker's partial results.
+ */
+struct stream_worker_s {
+    stream_job *    job;
+    as_stream       istream;
+    as_stream       ostream;
+    as_list *       partials;
+    bool            read;           // read at least one value
+    uint32_t        pos;
+    uint32_t        count;
+    as_val *        chunk[STREAM_WORKER_CHUNK];
+};
+
+/**
+ * Reads the partial results of the workers, in order.
+ */
+struct stream_merge_s {
+    stream_worker * workers;
+    uint32_t        n;
+    bool            skip;           // skip the workers that read no values
+    uint32_t        i;
+    uint32_t        pos;
+};
+
 /******************************************************************************
  * VARIABLES
  ******************************************************************************/
@@ -114,12 +305,68 @@ static pthread_rwlock_t lock;
 
 static cf_rchash * centry_hash = NULL;
 
+static uint32_t filename_hash_seed = 0;
+
+/**
+ * Precompiled modules, keyed by module name.
+ * Internally locked, as it is read while g_cache_lock is held.
+ */
+static cf_rchash * bytecode_hash = NULL;
+
+/**
+ * Source of cache entry versions. Each (re)initialized entry takes the
+ * next one, so a version is never reused, even by an entry of the same
+ * name. Any state leased or cached under an older version of its entry
+ * is stale.
+ */
+static cf_atomic32 cache_version = 0;
+
+/**
+ * Bytes held by the states queued in all cache entries.
+ */
+static cf_atomic64 cache_memory = 0;
+
+/**
+ * Time (seconds) of the last idle sweep of the cache entries.
+ */
+static cf_atomic32 cache_sweep_time = 0;
+static pthread_mutex_t cache_sweep_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Entries waiting for the prewarm threads to create their states.
+ * NULL when no prewarm thread could be started.
+ */
+static cf_queue * prewarm_q = NULL;
+
+/**
+ * Partitions waiting for the stream worker threads. NULL when
+ * stream_workers is not configured, or no thread could be started.
+ */
+static cf_queue * stream_q = NULL;
+
+static bool trace_enabled = false;
+
+static __thread thread_cache * tcache = NULL;
+static pthread_key_t tcache_key;
+static pthread_once_t tcache_key_once = PTHREAD_ONCE_INIT;
+
+/**
+ * All thread caches, so an entry's states can be drained from each.
+ */
+static thread_cache * tcache_list = NULL;
+static pthread_mutex_t tcache_list_lock = PTHREAD_MUTEX_INITIALIZER;
+
 // static uint32_t cache_size = 0;
 
 static const as_module_hooks hooks;
 
 static jmp_buf panic_jmp;
 
+/**
+ * Registry key for a state's state_refs.
+ */
+static char state_refs_key;
+
 /**
  * Lua Module Specific Data
  * This will populate the module.source field
@@ -127,6 +374,9 @@ static jmp_buf panic_jmp;
 static context mod_lua_source = {
     .config = {
         .cache_enabled  = true,
+        .cache_state_min = CACHE_ENTRY_STATE_MIN,
+        .cache_state_max = CACHE_ENTRY_STATE_MAX,
+        .cache_idle_decay = CACHE_ENTRY_IDLE_DECAY,
         .system_path    = MOD_LUA_CONFIG_SYSPATH,
         .user_path      = MOD_LUA_CONFIG_USRPATH,
         .server_mode    = true
@@ -147,8 +397,10 @@ static lua_State * create_state(context *, const char *filename);
 static int poll_state(context *, cache_item *);
 static int offer_state(context *, cache_item *);
 
+static void * stream_worker_thread(void *);
+
 static void panic_setjmp(void);
-// static int handle_error(lua_State *);
+static int handle_error(lua_State *);
 static int handle_panic(lua_State *);
 
 
@@ -156,48 +408,556 @@ static int handle_panic(lua_State *);
  * FUNCTIONS
  ******************************************************************************/
 
-// Raj (todo) fix stupid hash function
+/**
+ * FNV-1a over the filename. The offset basis is mixed with a per-process
+ * seed, so module names cannot be chosen to collide on a bucket.
+ */
 uint32_t filename_hash_fn(void *filename, uint32_t len) {   
-    char *b = filename;
-    uint32_t acc = 0;
-    for (int i=0;i<len;i++) {
-        acc += *(b+i);
+    const uint8_t * b = (const uint8_t *) filename;
+    uint32_t acc = 2166136261u ^ filename_hash_seed;
+    for ( uint32_t i = 0; i < len; i++ ) {
+        acc ^= b[i];
+        acc *= 16777619u;
     }
-    return(acc);
+    return acc;
+}
+
+/**
+ * Cache whether the logger traces. Refreshed on configure, and on each
+ * cache sweep, so a level change is picked up within cache_idle_decay.
+ */
+static void trace_refresh(void) {
+    trace_enabled = mod_lua.logger != NULL && as_logger_is_enabled(mod_lua.logger, AS_LOGGER_LEVEL_TRACE);
+}
+
+static void state_close(lua_State * l) {
+    mod_lua_alloc_close(l);
+    mod_lua_stats_cache(MOD_LUA_STATS_CACHE_CLOSE);
+}
+
+/**
+ * Bytes allocated by a state.
+ */
+static inline uint64_t state_memory(lua_State * l) {
+    return ((uint64_t) lua_gc(l, LUA_GCCOUNT, 0) << 10) + (uint64_t) lua_gc(l, LUA_GCCOUNTB, 0);
+}
+
+/**
+ * Queue a state in the entry, if the entry has room for it and the
+ * memory budget allows it.
+ *
+ * @return true if the entry took ownership of the state, otherwise false
+ */
+static bool cache_entry_push(context * ctx, cache_entry * centry, lua_State * l) {
+    if ( CF_Q_SZ(centry->lua_state_q) >= cf_atomic32_get(centry->max_cache_size) ) {
+        return false;
+    }
+    uint64_t size = state_memory(l);
+    uint64_t used = cf_atomic64_add(&cache_memory, size);
+    if ( ctx->config.cache_memory_max && used > ctx->config.cache_memory_max ) {
+        cf_atomic64_sub(&cache_memory, size);
+        TRACE("[CACHE] memory budget reached: %s", centry->key);
+        return false;
+    }
+    cf_queue_push(centry->lua_state_q, &l);
+    return true;
+}
+
+/**
+ * Take a state from the entry's queue.
+ *
+ * @return the state, or NULL if the queue is empty
+ */
+static lua_State * cache_entry_pop(cache_entry * centry) {
+    lua_State * l = NULL;
+    if ( cf_queue_pop(centry->lua_state_q, &l, CF_QUEUE_NOWAIT) != CF_QUEUE_OK ) {
+        return NULL;
+    }
+    cf_atomic64_sub(&cache_memory, state_memory(l));
+    // Approximate, racing pollers may each record their own size.
+    uint32_t size = CF_Q_SZ(centry->lua_state_q);
+    if ( size < cf_atomic32_get(centry->low_water) ) {
+        cf_atomic32_set(&centry->low_water, size);
+    }
+    return l;
 }
 
 static inline int cache_entry_cleanup(cache_entry * centry) {
     lua_State *l = NULL;
-    while(cf_queue_pop(centry->lua_state_q, &l, CF_QUEUE_NOWAIT) == CF_QUEUE_OK) {
-        lua_close(l);
+    while ( (l = cache_entry_pop(centry)) != NULL ) {
+        state_close(l);
     }
     return 0;
 }
 
+static void cache_entry_destroy(void * object) {
+    cache_entry * centry = (cache_entry *) object;
+    cache_entry_cleanup(centry);
+    cf_queue_destroy(centry->lua_state_q);
+}
+
+/**
+ * Release a reference to the entry, destroying it with the last one.
+ */
+static void cache_entry_release(cache_entry * centry) {
+    if ( cf_rc_release(centry) == 0 ) {
+        cache_entry_destroy(centry);
+        cf_rc_free(centry);
+    }
+}
+
 static inline int cache_entry_populate(context *ctx, cache_entry *centry, const char *key) {
     lua_State *l = NULL;
-    for ( int i = 0; i < CACHE_ENTRY_STATE_MIN; i++ ) {
+    for ( uint32_t i = 0; i < ctx->config.cache_state_min; i++ ) {
         l = create_state(ctx, key);
-        if (l) cf_queue_push(centry->lua_state_q, &l);
+        if ( l && !cache_entry_push(ctx, centry, l) ) {
+            state_close(l);
+            break;
+        }
+    }
+    cf_atomic32_set(&centry->low_water, CF_Q_SZ(centry->lua_state_q));
+    return 0;
+}
+
+typedef struct {
+    context *   ctx;
+    cf_queue *  idle;               // states to close once the reduce is done
+} cache_decay_data;
+
+/**
+ * Take the states an entry did not need since the last sweep.
+ *
+ * The fewest states queued during the period were never leased, so
+ * they are taken to be closed, and the entry's capacity decays by as
+ * many, down to cache_state_min. The states are only queued here, as
+ * the hash's bucket locks are held for the whole reduce.
+ */
+static int cache_entry_decay(void * key, uint32_t keylen, void * object, void * udata) {
+    cache_decay_data *  data    = (cache_decay_data *) udata;
+    cache_entry *       centry  = (cache_entry *) object;
+
+    uint32_t idle = cf_atomic32_get(centry->low_water);
+    uint32_t size = cf_atomic32_get(centry->max_cache_size);
+    uint32_t min = data->ctx->config.cache_state_min;
+
+    if ( size > min ) {
+        cf_atomic32_set(&centry->max_cache_size, size > idle && size - idle > min ? size - idle : min);
+    }
+
+    lua_State * l = NULL;
+    for ( uint32_t i = 0; i < idle && (l = cache_entry_pop(centry)) != NULL; i++ ) {
+        cf_queue_push(data->idle, &l);
     }
+
+    if ( idle > 0 ) {
+        TRACE("[CACHE] closing %d idle states: %s (%d)", idle, centry->key, cf_atomic32_get(centry->max_cache_size));
+    }
+
+    cf_atomic32_set(&centry->low_water, CF_Q_SZ(centry->lua_state_q));
     return 0;
 }
 
+/**
+ * Sweep idle states from all entries, at most once per cache_idle_decay
+ * seconds. Only one thread sweeps, the others carry on. The states are
+ * closed after the reduce, so polls and offers do not wait on them.
+ */
+static void cache_sweep(context * ctx) {
+    uint32_t now = (uint32_t) time(NULL);
+    if ( now - cf_atomic32_get(cache_sweep_time) < ctx->config.cache_idle_decay ) {
+        return;
+    }
+    if ( pthread_mutex_trylock(&cache_sweep_lock) != 0 ) {
+        return;
+    }
+    if ( now - cf_atomic32_get(cache_sweep_time) >= ctx->config.cache_idle_decay ) {
+        cf_atomic32_set(&cache_sweep_time, now);
+        trace_refresh();
+
+        cache_decay_data data = {
+            .ctx    = ctx,
+            .idle   = cf_queue_create(sizeof(lua_State *), false)
+        };
+
+        if ( data.idle != NULL ) {
+            cf_rchash_reduce(centry_hash, cache_entry_decay, &data);
+
+            lua_State * l = NULL;
+            while ( cf_queue_pop(data.idle, &l, CF_QUEUE_NOWAIT) == CF_QUEUE_OK ) {
+                state_close(l);
+            }
+            cf_queue_destroy(data.idle);
+        }
+    }
+    pthread_mutex_unlock(&cache_sweep_lock);
+}
+
 /**
  * Clear the entry:
  *  - truncate the key
  *  - truncate the gen
+ *  - stamp the version
  *  - release all lua_States
- *  - set size to 0
+ * States are created afterwards, by cache_entry_prewarm().
  */
-static inline int cache_entry_init(context * ctx, cache_entry * centry, const char *key, const char *gen) {
-    cache_entry_cleanup(centry);
-    cache_entry_populate(ctx, centry, key);
+static inline int cache_entry_init(context * ctx, cache_entry * centry, const char *key, const char *gen, uint32_t version) {
     strncpy(centry->key, key, CACHE_ENTRY_KEY_MAX);
     strncpy(centry->gen, gen, CACHE_ENTRY_GEN_MAX);
+    cf_atomic32_set(&centry->version, version);
+    cache_entry_cleanup(centry);
+    return 0;
+}
+
+/**
+ * Hand a published entry to the prewarm threads. Until they fill it,
+ * polls miss and create states on demand. Without prewarm threads, the
+ * entry is populated by the caller.
+ */
+static void cache_entry_prewarm(context * ctx, cache_entry * centry) {
+    if ( prewarm_q == NULL ) {
+        cache_entry_populate(ctx, centry, centry->key);
+        return;
+    }
+    prewarm_job job = {
+        .centry     = centry,
+        .version    = cf_atomic32_get(centry->version)
+    };
+    cf_rc_reserve(centry);
+    cf_queue_push(prewarm_q, &job);
+}
+
+/**
+ * Prewarm thread: creates cache_state_min states for each queued entry,
+ * stopping early if the entry is reinitialized or removed. Each state is
+ * created and queued under ctx->lock, so module updates exclude it.
+ */
+static void * prewarm_worker(void * udata) {
+    context *   ctx = (context *) udata;
+    prewarm_job job;
+
+    while ( cf_queue_pop(prewarm_q, &job, CF_QUEUE_FOREVER) == CF_QUEUE_OK ) {
+        cache_entry * centry = job.centry;
+
+        for ( uint32_t i = 0; i < ctx->config.cache_state_min; i++ ) {
+            lua_State * l = NULL;
+
+            pthread_rwlock_rdlock(ctx->lock);
+            if ( cf_atomic32_get(centry->version) == job.version
+                && CF_Q_SZ(centry->lua_state_q) < ctx->config.cache_state_min ) {
+                l = create_state(ctx, centry->key);
+            }
+            if ( l && ( cf_atomic32_get(centry->version) != job.version || !cache_entry_push(ctx, centry, l) ) ) {
+                state_close(l);
+                l = NULL;
+            }
+            pthread_rwlock_unlock(ctx->lock);
+
+            if ( l == NULL ) break;
+        }
+
+        TRACE("[CACHE] prewarmed: %s (%d)", centry->key, CF_Q_SZ(centry->lua_state_q));
+        cache_entry_release(centry);
+    }
+    return NULL;
+}
+
+/**
+ * Release all states held by a thread cache entry.
+ */
+static void thread_cache_entry_cleanup(thread_cache_entry * tentry) {
+    while ( tentry->size > 0 ) {
+        tentry->size--;
+        state_close(tentry->states[tentry->size]);
+        tentry->states[tentry->size] = NULL;
+    }
+    tentry->key[0] = '\0';
+    if ( tentry->centry != NULL ) {
+        cache_entry_release(tentry->centry);
+        tentry->centry = NULL;
+    }
+}
+
+/**
+ * Called on thread exit to release the thread's cached states.
+ */
+static void thread_cache_destroy(void * p) {
+    thread_cache * tc = (thread_cache *) p;
+
+    pthread_mutex_lock(&tcache_list_lock);
+    if ( tc->prev ) tc->prev->next = tc->next;
+    else tcache_list = tc->next;
+    if ( tc->next ) tc->next->prev = tc->prev;
+    pthread_mutex_unlock(&tcache_list_lock);
+
+    for ( int i = 0; i < THREAD_CACHE_ENTRY_MAX; i++ ) {
+        thread_cache_entry_cleanup(&tc->entries[i]);
+    }
+    pthread_mutex_destroy(&tc->lock);
+    free(tc);
+}
+
+static void thread_cache_key_init(void) {
+    pthread_key_create(&tcache_key, thread_cache_destroy);
+}
+
+/**
+ * Close the states every thread cached for an entry that was just
+ * reinitialized or removed, rather than leaving them until each thread
+ * next uses the module, or exits.
+ */
+static void thread_cache_drain(cache_entry * centry) {
+    pthread_mutex_lock(&tcache_list_lock);
+    for ( thread_cache * tc = tcache_list; tc != NULL; tc = tc->next ) {
+        pthread_mutex_lock(&tc->lock);
+        for ( int i = 0; i < THREAD_CACHE_ENTRY_MAX; i++ ) {
+            thread_cache_entry * tentry = &tc->entries[i];
+            if ( tentry->size > 0 && tentry->centry == centry ) {
+                thread_cache_entry_cleanup(tentry);
+            }
+        }
+        pthread_mutex_unlock(&tc->lock);
+    }
+    pthread_mutex_unlock(&tcache_list_lock);
+}
+
+/**
+ * Take a state for the module from the calling thread's cache.
+ * Only the thread's own lock is taken. States cached under an older
+ * version of their entry are closed rather than returned.
+ *
+ * @return 0 if citem was populated with a state, otherwise 1
+ */
+static int thread_cache_poll(cache_item * citem) {
+    thread_cache * tc = tcache;
+    if ( tc == NULL ) return 1;
+
+    int rc = 1;
+    pthread_mutex_lock(&tc->lock);
+    for ( int i = 0; i < THREAD_CACHE_ENTRY_MAX; i++ ) {
+        thread_cache_entry * tentry = &tc->entries[i];
+        if ( tentry->size == 0 || strncmp(tentry->key, citem->key, CACHE_ENTRY_KEY_MAX) ) {
+            continue;
+        }
+        if ( tentry->version != cf_atomic32_get(tentry->centry->version) ) {
+            thread_cache_entry_cleanup(tentry);
+            break;
+        }
+        tentry->size--;
+        citem->state = tentry->states[tentry->size];
+        tentry->states[tentry->size] = NULL;
+        strncpy(citem->gen, tentry->gen, CACHE_ENTRY_GEN_MAX);
+        citem->version = tentry->version;
+        citem->centry = tentry->centry;
+        cf_rc_reserve(citem->centry);
+        if ( tentry->size == 0 ) {
+            thread_cache_entry_cleanup(tentry);
+        }
+        rc = 0;
+        break;
+    }
+    pthread_mutex_unlock(&tc->lock);
+    return rc;
+}
+
+/**
+ * Give a state back to the calling thread's cache. A state is only
+ * kept if it is current, and there is room for it.
+ *
+ * @return 0 if the thread cache took ownership of the state, otherwise 1
+ */
+static int thread_cache_offer(cache_item * citem) {
+    if ( citem->centry == NULL || citem->version != cf_atomic32_get(citem->centry->version) ) return 1;
+
+    thread_cache * tc = tcache;
+    if ( tc == NULL ) {
+        pthread_once(&tcache_key_once, thread_cache_key_init);
+        tc = (thread_cache *) calloc(1, sizeof(thread_cache));
+        if ( tc == NULL ) return 1;
+        pthread_mutex_init(&tc->lock, NULL);
+        pthread_mutex_lock(&tcache_list_lock);
+        tc->next = tcache_list;
+        if ( tcache_list ) tcache_list->prev = tc;
+        tcache_list = tc;
+        pthread_mutex_unlock(&tcache_list_lock);
+        pthread_setspecific(tcache_key, tc);
+        tcache = tc;
+    }
+
+    pthread_mutex_lock(&tc->lock);
+
+    thread_cache_entry * tentry = NULL;
+    for ( int i = 0; i < THREAD_CACHE_ENTRY_MAX; i++ ) {
+        thread_cache_entry * e = &tc->entries[i];
+        if ( e->size > 0 && !strncmp(e->key, citem->key, CACHE_ENTRY_KEY_MAX) ) {
+            if ( e->centry != citem->centry || e->version != citem->version ) {
+                thread_cache_entry_cleanup(e);
+            }
+            tentry = e;
+            break;
+        }
+        if ( e->size == 0 && tentry == NULL ) {
+            tentry = e;
+        }
+    }
+
+    if ( tentry == NULL || tentry->size >= THREAD_CACHE_STATE_MAX ) {
+        pthread_mutex_unlock(&tc->lock);
+        return 1;
+    }
+
+    if ( tentry->size == 0 ) {
+        strncpy(tentry->key, citem->key, CACHE_ENTRY_KEY_MAX);
+        strncpy(tentry->gen, citem->gen, CACHE_ENTRY_GEN_MAX);
+        tentry->version = citem->version;
+        tentry->centry = citem->centry;
+        cf_rc_reserve(tentry->centry);
+    }
+    tentry->states[tentry->size] = citem->state;
+    tentry->size++;
+    citem->state = NULL;
+
+    pthread_mutex_unlock(&tc->lock);
     return 0;
 }
 
+/**
+ * lua_Writer for lua_dump(), appends the chunk to a bytecode_buffer.
+ */
+static int bytecode_write(lua_State * l, const void * p, size_t sz, void * udata) {
+    bytecode_buffer * buf = (bytecode_buffer *) udata;
+    if ( buf->size + sz > buf->capacity ) {
+        size_t capacity = buf->capacity ? buf->capacity * 2 : 4096;
+        while ( capacity < buf->size + sz ) capacity *= 2;
+        char * data = (char *) realloc(buf->data, capacity);
+        if ( data == NULL ) return 1;
+        buf->data = data;
+        buf->capacity = capacity;
+    }
+    memcpy(buf->data + buf->size, p, sz);
+    buf->size += sz;
+    return 0;
+}
+
+static void bytecode_remove(const char * name) {
+    if ( bytecode_hash == NULL ) return;
+    cf_rchash_delete(bytecode_hash, (void *) name, strlen(name));
+}
+
+/**
+ * Compiles the module to bytecode and stores it in bytecode_hash,
+ * replacing any earlier version. The module is resolved in the same
+ * order as package.path: system path first, then user path.
+ *
+ * @return 0 on success, 1 if there is no such lua file, 2 on error.
+ */
+static int bytecode_compile(context * ctx, const char * name) {
+    if ( bytecode_hash == NULL ) return 2;
+
+    char        path[1024];
+    struct stat buf;
+
+    snprintf(path, sizeof(path), "%s/%s.lua", ctx->config.system_path, name);
+    if ( stat(path, &buf) ) {
+        snprintf(path, sizeof(path), "%s/%s.lua", ctx->config.user_path, name);
+        if ( stat(path, &buf) ) {
+            bytecode_remove(name);
+            return 1;
+        }
+    }
+
+    lua_State * l = luaL_newstate();
+    if ( l == NULL ) return 2;
+
+    if ( luaL_loadfile(l, path) ) {
+        as_logger_error(mod_lua.logger, "Lua Compile Error: %s", lua_tostring(l, -1));
+        lua_close(l);
+        bytecode_remove(name);
+        return 2;
+    }
+
+    bytecode_buffer chunk = {
+        .data       = NULL,
+        .size       = 0,
+        .capacity   = 0
+    };
+
+    int rc = lua_dump(l, bytecode_write, &chunk);
+    lua_close(l);
+
+    if ( rc ) {
+        free(chunk.data);
+        bytecode_remove(name);
+        return 2;
+    }
+
+    bytecode * bc = (bytecode *) cf_rc_alloc(sizeof(bytecode) + chunk.size);
+    strncpy(bc->name, name, CACHE_ENTRY_KEY_MAX);
+    bc->name[CACHE_ENTRY_KEY_MAX - 1] = '\0';
+    bc->size = chunk.size;
+    memcpy(bc->data, chunk.data, chunk.size);
+    free(chunk.data);
+
+    bytecode_remove(name);
+    if ( CF_RCHASH_OK != cf_rchash_put(bytecode_hash, (void *) name, strlen(name), (void *) bc) ) {
+        cf_rc_releaseandfree(bc);
+        return 2;
+    }
+
+    TRACE("[BYTECODE] compiled %s (%zu bytes)", path, chunk.size);
+    return 0;
+}
+
+/**
+ * Compiles every lua file in a directory.
+ */
+static int bytecode_scan_dir(context * ctx, const char * directory) {
+    DIR *           dir     = NULL;
+    struct dirent * dentry  = NULL;
+
+    dir = opendir(directory);
+
+    if ( dir == 0 ) return -1;
+
+    while ( (dentry = readdir(dir)) ) {
+        char    key[CACHE_ENTRY_KEY_MAX]    = "";
+        size_t  len                         = strlen(dentry->d_name);
+
+        if ( len <= 4 || len >= CACHE_ENTRY_KEY_MAX ) continue;
+        if ( strcmp(dentry->d_name + len - 4, ".lua") ) continue;
+
+        memcpy(key, dentry->d_name, len - 4);
+        bytecode_compile(ctx, key);
+    }
+
+    closedir(dir);
+
+    return 0;
+}
+
+/**
+ * Package loader which loads modules from bytecode_hash.
+ * It is installed ahead of the lua file loader, so modules which were
+ * compiled are not read and parsed again on every state creation.
+ */
+static int bytecode_loader(lua_State * l) {
+    const char *    name    = luaL_checkstring(l, 1);
+    bytecode *      bc      = NULL;
+
+    if ( bytecode_hash == NULL || CF_RCHASH_OK != cf_rchash_get(bytecode_hash, (void *) name, strlen(name), (void **) &bc) ) {
+        lua_pushfstring(l, "\n\tno precompiled module '%s'", name);
+        return 1;
+    }
+
+    int rc = luaL_loadbuffer(l, bc->data, bc->size, bc->name);
+    cf_rc_releaseandfree(bc);
+
+    if ( rc ) {
+        return luaL_error(l, "error loading module '%s':\n\t%s", name, lua_tostring(l, -1));
+    }
+
+    return 1;
+}
+
 int cache_rm(context * ctx, const char *key) {
     if ( !key || ( strlen(key) == 0 )) return 0;
     cache_entry     * centry = NULL;
@@ -207,10 +967,12 @@ int cache_rm(context * ctx, const char *key) {
         return 0;
     }
     cf_rchash_delete(centry_hash, (void *)key, strlen(key));
+    cf_atomic32_set(&centry->version, 0);
     UNLOCK;
+    bytecode_remove(key);
+    thread_cache_drain(centry);
     cache_entry_cleanup(centry);
-    cf_queue_destroy(centry->lua_state_q);
-    cf_rc_releaseandfree(centry);
+    cache_entry_release(centry);
     centry = 0;
     return 0;
 }
@@ -218,14 +980,14 @@ int cache_rm(context * ctx, const char *key) {
 int cache_init(context * ctx, const char *key, const char * gen) {
     if (strlen(key) == 0) return 0;
     cache_entry     * centry = NULL;
+    bytecode_compile(ctx, key);
     WRLOCK;
     if (CF_RCHASH_OK != cf_rchash_get(centry_hash, (void *)key, strlen(key), (void *)&centry)) {
         centry = cf_rc_alloc(sizeof(cache_entry)); 
-        cf_atomic32_set(&centry->total, 0);
         cf_atomic32_set(&centry->cache_miss, 0);
-        centry->max_cache_size = CACHE_ENTRY_STATE_MAX;
+        cf_atomic32_set(&centry->max_cache_size, ctx->config.cache_state_min);
         centry->lua_state_q = cf_queue_create(sizeof(lua_State *), true);
-        cache_entry_init(ctx, centry, key, gen);
+        cache_entry_init(ctx, centry, key, gen, cf_atomic32_incr(&cache_version));
         int retval = cf_rchash_put(centry_hash, (void *)key, strlen(key), (void *)centry);
         UNLOCK;
         if (retval != CF_RCHASH_OK) {
@@ -234,12 +996,17 @@ int cache_init(context * ctx, const char *key, const char * gen) {
             cf_rc_releaseandfree(centry);
             return 1;
         } else {
-            as_logger_trace(mod_lua.logger, "[CACHE] Added [%s:%p]", key, centry);
+            TRACE("[CACHE] Added [%s:%p]", key, centry);
         }
+        // published, so it can be prewarmed without the lock
+        cache_entry_prewarm(ctx, centry);
     } else { 
+        uint32_t version = cf_atomic32_incr(&cache_version);
         UNLOCK;
-        cache_entry_init(ctx, centry, key, gen);
-        cf_rc_releaseandfree(centry);
+        cache_entry_init(ctx, centry, key, gen, version);
+        thread_cache_drain(centry);
+        cache_entry_prewarm(ctx, centry);
+        cache_entry_release(centry);
         centry = 0;
     }
     return 0;
@@ -339,12 +1106,40 @@ static int update(as_module * m, as_module_event * e) {
         case AS_MODULE_EVENT_CONFIGURE: {
             mod_lua_config * config     = (mod_lua_config *) e->data.config;
 
+            trace_refresh();
+
             ctx->config.server_mode     = config->server_mode;
             ctx->config.cache_enabled   = config->cache_enabled;
+            ctx->config.thread_cache_enabled = config->thread_cache_enabled;
+            ctx->config.batch_gc_interval = config->batch_gc_interval;
+            ctx->config.alloc_trim      = config->alloc_trim;
+            ctx->config.stats_enabled   = config->stats_enabled;
+            ctx->config.cache_state_max = config->cache_state_max ? config->cache_state_max : CACHE_ENTRY_STATE_MAX;
+            ctx->config.cache_state_min = config->cache_state_min ? config->cache_state_min : CACHE_ENTRY_STATE_MIN;
+            if ( ctx->config.cache_state_min > ctx->config.cache_state_max ) {
+                ctx->config.cache_state_min = ctx->config.cache_state_max;
+            }
+            ctx->config.cache_idle_decay = config->cache_idle_decay ? config->cache_idle_decay : CACHE_ENTRY_IDLE_DECAY;
+            ctx->config.cache_memory_max = config->cache_memory_max;
+            ctx->config.stream_workers  = config->stream_workers < STREAM_WORKERS_MAX ? config->stream_workers : STREAM_WORKERS_MAX;
+            ctx->config.aggregate_flush_bytes = config->aggregate_flush_bytes;
+            mod_lua_stream_flush_bytes(config->aggregate_flush_bytes);
+
+            if ( filename_hash_seed == 0 ) {
+                filename_hash_seed = ((uint32_t) time(NULL) ^ ((uint32_t) getpid() << 16)) | 1;
+            }
 
             if ( centry_hash == NULL && ctx->config.cache_enabled ) {
-                // No Internal Lock
-                int rc = cf_rchash_create(&centry_hash, filename_hash_fn, NULL, 0, 64, 0);
+                // Lookups rely on the per-bucket locks, so they never
+                // contend with g_cache_lock, which only serializes writers.
+                int rc = cf_rchash_create(&centry_hash, filename_hash_fn, cache_entry_destroy, 0, CACHE_TABLE_ENTRY_MAX, CF_RCHASH_CR_MT_MANYLOCK);
+                if ( CF_RCHASH_OK != rc ) {
+                    return 1;
+                }
+            }
+
+            if ( bytecode_hash == NULL && ctx->config.cache_enabled ) {
+                int rc = cf_rchash_create(&bytecode_hash, filename_hash_fn, NULL, 0, CACHE_TABLE_ENTRY_MAX, CF_RCHASH_CR_MT_MANYLOCK);
                 if ( CF_RCHASH_OK != rc ) {
                     return 1;
                 }
@@ -359,8 +1154,45 @@ static int update(as_module * m, as_module_event * e) {
                 if (0 != pthread_rwlockattr_setkind_np(&rwattr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP)) {
                     return 3;
                 }
-                if (0 != pthread_rwlock_init(ctx->lock, &rwattr)) {
-                    return 3;
+                if (0 != pthread_rwlock_init(ctx->lock, &rwattr)) {
+                    return 3;
+                }
+            }
+
+            if ( stream_q == NULL && ctx->config.stream_workers > 1 ) {
+                // the caller of a stream apply is its first worker
+                uint32_t nthreads = ctx->config.stream_workers - 1;
+                uint32_t started = 0;
+                stream_q = cf_queue_create(sizeof(stream_worker *), true);
+                for ( uint32_t i = 0; i < nthreads; i++ ) {
+                    pthread_t thread;
+                    if ( pthread_create(&thread, NULL, stream_worker_thread, ctx) == 0 ) {
+                        pthread_detach(thread);
+                        started++;
+                    }
+                }
+                if ( started == 0 ) {
+                    // stream applies run on the caller alone
+                    cf_queue_destroy(stream_q);
+                    stream_q = NULL;
+                }
+            }
+
+            if ( prewarm_q == NULL && ctx->config.cache_enabled ) {
+                uint32_t nthreads = config->prewarm_threads ? config->prewarm_threads : PREWARM_THREADS;
+                uint32_t started = 0;
+                prewarm_q = cf_queue_create(sizeof(prewarm_job), true);
+                for ( uint32_t i = 0; i < nthreads; i++ ) {
+                    pthread_t thread;
+                    if ( pthread_create(&thread, NULL, prewarm_worker, ctx) == 0 ) {
+                        pthread_detach(thread);
+                        started++;
+                    }
+                }
+                if ( started == 0 ) {
+                    // entries will be populated synchronously
+                    cf_queue_destroy(prewarm_q);
+                    prewarm_q = NULL;
                 }
             }
             
@@ -396,7 +1228,10 @@ static int update(as_module * m, as_module_event * e) {
                 dir = NULL;
             }
 
-            if ( ctx->config.cache_enabled ) cache_scan_dir(ctx, ctx->config.user_path);
+            if ( ctx->config.cache_enabled ) {
+                bytecode_scan_dir(ctx, ctx->config.system_path);
+                cache_scan_dir(ctx, ctx->config.user_path);
+            }
 
             break;
         }
@@ -470,6 +1305,26 @@ static void package_cpath_set(lua_State * l, char * system_path, char * user_pat
     lua_pop(l, 1);
 }
 
+/**
+ * Installs bytecode_loader as package.loaders[2], right after the
+ * preload loader and ahead of the lua file loader.
+ */
+static void package_loader_set(lua_State * l) {
+    lua_getglobal(l, "package");
+    lua_getfield(l, -1, "loaders");
+
+    int n = (int) lua_objlen(l, -1);
+    for ( int i = n; i >= 2; i-- ) {
+        lua_rawgeti(l, -1, i);
+        lua_rawseti(l, -2, i + 1);
+    }
+
+    lua_pushcfunction(l, bytecode_loader);
+    lua_rawseti(l, -2, 2);
+
+    lua_pop(l, 2);
+}
+
 /**
  * Checks whether a module is native (i.e., a ".so" file.)
  *
@@ -493,6 +1348,107 @@ static bool is_native_module(context * ctx, const char *filename)
 	return false;
 }
 
+/**
+ * Creates the state's state_refs, along with the "aerospike" global,
+ * and resolves the dispatchers defined in aerospike.lua.
+ */
+static void state_refs_init(lua_State * l) {
+    lua_pushlightuserdata(l, &state_refs_key);
+    state_refs * refs = (state_refs *) lua_newuserdata(l, sizeof(state_refs));
+    memset(refs, 0, sizeof(state_refs));
+    lua_rawset(l, LUA_REGISTRYINDEX);
+
+    mod_lua_pushaerospike(l, NULL);
+    refs->aerospike = (mod_lua_box *) lua_touserdata(l, -1);
+    lua_pushvalue(l, -1);
+    refs->aerospike_ref = luaL_ref(l, LUA_REGISTRYINDEX);
+    lua_setglobal(l, "aerospike");
+
+    lua_getglobal(l, "apply_record");
+    refs->apply_record = luaL_ref(l, LUA_REGISTRYINDEX);
+
+    lua_getglobal(l, "apply_stream");
+    refs->apply_stream = luaL_ref(l, LUA_REGISTRYINDEX);
+
+    lua_getglobal(l, "apply_stream_split");
+    refs->apply_stream_split = luaL_ref(l, LUA_REGISTRYINDEX);
+
+    lua_getglobal(l, "apply_stream_partial");
+    refs->apply_stream_partial = luaL_ref(l, LUA_REGISTRYINDEX);
+
+    lua_getglobal(l, "apply_stream_merge");
+    refs->apply_stream_merge = luaL_ref(l, LUA_REGISTRYINDEX);
+
+    lua_pushcfunction(l, handle_error);
+    refs->handle_error = luaL_ref(l, LUA_REGISTRYINDEX);
+}
+
+static state_refs * state_refs_get(lua_State * l) {
+    lua_pushlightuserdata(l, &state_refs_key);
+    lua_rawget(l, LUA_REGISTRYINDEX);
+    state_refs * refs = (state_refs *) lua_touserdata(l, -1);
+    lua_pop(l, 1);
+    return refs;
+}
+
+/**
+ * Pushes the named global function onto the stack, or nil if it does
+ * not exist. The first time a function is resolved in a state, it is
+ * sandboxed with env_record() and remembered in the state_refs, so
+ * later calls skip the globals lookup. A function that can not be
+ * sandboxed is logged, pushed as nil so the apply fails, and not
+ * remembered.
+ */
+static void state_refs_pushfunction(lua_State * l, state_refs * refs, const char * name) {
+
+    for ( uint32_t i = 0; i < refs->nfunctions; i++ ) {
+        if ( strcmp(refs->functions[i].name, name) == 0 ) {
+            lua_rawgeti(l, LUA_REGISTRYINDEX, refs->functions[i].ref);
+            return;
+        }
+    }
+
+    lua_getglobal(l, name);
+    if ( !lua_isfunction(l, -1) ) {
+        return;
+    }
+
+    int f = lua_gettop(l);
+
+    // sandbox the function, unless it already was
+    lua_getglobal(l, "sandboxed");
+    if ( !lua_istable(l, -1) ) {
+        as_logger_error(mod_lua.logger, "Unable to sandbox %s: sandboxed is not a table", name);
+        lua_settop(l, f - 1);
+        lua_pushnil(l);
+        return;
+    }
+    lua_pushvalue(l, f);
+    lua_rawget(l, -2);
+    if ( !lua_toboolean(l, -1) ) {
+        lua_getglobal(l, "env_record");
+        if ( lua_pcall(l, 0, 1, 0) != 0 ) {
+            as_logger_error(mod_lua.logger, "Unable to sandbox %s: %s", name, lua_tostring(l, -1));
+            lua_settop(l, f - 1);
+            lua_pushnil(l);
+            return;
+        }
+        lua_setfenv(l, f);
+        lua_pushvalue(l, f);
+        lua_pushboolean(l, true);
+        lua_rawset(l, -4);
+    }
+    lua_settop(l, f);
+
+    if ( refs->nfunctions < STATE_FUNCTION_MAX && strlen(name) < STATE_FUNCTION_NAME_MAX ) {
+        state_function * sf = &refs->functions[refs->nfunctions];
+        strcpy(sf->name, name);
+        lua_pushvalue(l, f);
+        sf->ref = luaL_ref(l, LUA_REGISTRYINDEX);
+        refs->nfunctions++;
+    }
+}
+
 /**
  * Creates a new context (lua_State) populating it with default values.
  *
@@ -501,13 +1457,22 @@ static bool is_native_module(context * ctx, const char *filename)
 static lua_State * create_state(context * ctx, const char * filename) {
     lua_State * l   = NULL;
 
-    l = lua_open();
+    l = mod_lua_alloc_newstate(mod_lua.memtracker);
+    if ( l == NULL ) {
+        as_logger_error(mod_lua.logger, "Lua Create Error: out of memory");
+        return NULL;
+    }
+    mod_lua_stats_cache(MOD_LUA_STATS_CACHE_CREATE);
 
     luaL_openlibs(l);
 
     package_path_set(l, ctx->config.system_path, ctx->config.user_path);
     package_cpath_set(l, ctx->config.system_path, ctx->config.user_path);
 
+    if ( bytecode_hash != NULL ) {
+        package_loader_set(l);
+    }
+
     mod_lua_aerospike_register(l);
     mod_lua_record_register(l);
     mod_lua_iterator_register(l);
@@ -515,18 +1480,22 @@ static lua_State * create_state(context * ctx, const char * filename) {
     mod_lua_list_register(l);
     mod_lua_map_register(l);
     mod_lua_bytes_register(l);
+    mod_lua_string_register(l);
+    mod_lua_hash_register(l);
 
     lua_getglobal(l, "require");
     lua_pushstring(l, "aerospike");
     int rc = lua_pcall(l, 1, 1, 0);
 	if (rc) {
         as_logger_error(mod_lua.logger, "Lua Create Error: %s", lua_tostring(l, -1));
-        lua_close(l);
+        state_close(l);
         return NULL;
     }
 
+    state_refs_init(l);
+
 	if (is_native_module(ctx, filename)) {
-		as_logger_trace(mod_lua.logger, "Not requiring native module: %s", filename);
+		TRACE("Not requiring native module: %s", filename);
 		return l;
 	}
 
@@ -535,7 +1504,7 @@ static lua_State * create_state(context * ctx, const char * filename) {
     rc = lua_pcall(l, 1, 1, 0);
     if (rc) {
         as_logger_error(mod_lua.logger, "Lua Create Error: %s", lua_tostring(l, -1));
-        lua_close(l);
+        state_close(l);
         return NULL;
     }
     return l;
@@ -551,48 +1520,57 @@ static lua_State * create_state(context * ctx, const char * filename) {
  * @return 0 on success, otherwise 1
  */
 static int poll_state(context * ctx, cache_item * citem) {
-    uint32_t miss = 0;
-    uint32_t total = 1;
     if ( ctx->config.cache_enabled == true ) {
+        if ( ctx->config.thread_cache_enabled == true ) {
+            if ( thread_cache_poll(citem) == 0 ) {
+                TRACE("[CACHE] took thread state: %s", citem->key);
+                mod_lua_stats_cache(MOD_LUA_STATS_CACHE_HIT);
+                return 0;
+            }
+        }
         cache_entry     * centry = NULL;
-        RDLOCK;
         int retval = cf_rchash_get(centry_hash, (void *)citem->key, strlen(citem->key), (void *)&centry);
-        UNLOCK;
         if (CF_RCHASH_OK == retval ) {
-            if (cf_queue_pop(centry->lua_state_q, &citem->state, CF_QUEUE_NOWAIT) != CF_QUEUE_EMPTY) {
+            // Read before the pop, so a state is never newer than its version.
+            citem->version = cf_atomic32_get(centry->version);
+            citem->state = cache_entry_pop(centry);
+            if ( citem->state != NULL ) {
+                mod_lua_stats_cache(MOD_LUA_STATS_CACHE_HIT);
                 strncpy(citem->key, centry->key, CACHE_ENTRY_KEY_MAX);
                 strncpy(citem->gen, centry->gen, CACHE_ENTRY_GEN_MAX);
-                as_logger_trace(mod_lua.logger, "[CACHE] took state: %s (%d)", citem->key, centry->max_cache_size);
+                TRACE("[CACHE] took state: %s (%d)", citem->key, cf_atomic32_get(centry->max_cache_size));
             } else {
-                miss = cf_atomic32_incr(&centry->cache_miss);
-                citem->state = NULL;
-            }
-            total = cf_atomic32_incr(&centry->total);
-            if (((miss * 100 / total) > 1) && 
-                    (total > 100000)) {
-                centry->max_cache_size++;
-                if (centry->max_cache_size > CACHE_ENTRY_STATE_MAX)
-                    centry->max_cache_size = CACHE_ENTRY_STATE_MAX; 
+                // Every miss is one more concurrent lease than the entry
+                // holds, so the entry grows by one for each, up to the max.
+                uint32_t miss = cf_atomic32_incr(&centry->cache_miss);
+                mod_lua_stats_cache(MOD_LUA_STATS_CACHE_MISS);
+                if ( cf_atomic32_get(centry->max_cache_size) < ctx->config.cache_state_max ) {
+                    cf_atomic32_incr(&centry->max_cache_size);
+                }
+                TRACE("[CACHE] Miss %d : %s (%d)", miss, citem->key, cf_atomic32_get(centry->max_cache_size));
             }
-            cf_rc_releaseandfree(centry);
-            centry = 0;
-            as_logger_trace(mod_lua.logger, "[CACHE] Miss %d : Total %d", miss, total);
+            // held until the state is offered back
+            citem->centry = centry;
         } else {
             centry = NULL;
         }
     }
     else {
-        as_logger_trace(mod_lua.logger, "[CACHE] is disabled.");
+        TRACE("[CACHE] is disabled.");
     }
 
     if ( citem->state == NULL ) {
         citem->gen[0] = '\0';
         citem->state = create_state(ctx, citem->key);
         if (!citem->state) {
-            as_logger_trace(mod_lua.logger, "[CACHE] state create failed: %s", citem->key);
+            TRACE("[CACHE] state create failed: %s", citem->key);
+            if ( citem->centry != NULL ) {
+                cache_entry_release(citem->centry);
+                citem->centry = NULL;
+            }
             return 1;
         } else { 
-            as_logger_trace(mod_lua.logger, "[CACHE] state created: %s", citem->key);
+            TRACE("[CACHE] state created: %s", citem->key);
         }
     }
 
@@ -614,36 +1592,49 @@ static int offer_state(context * ctx, cache_item * citem) {
         // lua itself does a garbage collection. Also do garbage 
         // collection outside the spinlock. arg for GCSTEP 2 is a 
         // random number. Experiment to get better number.
-        lua_gc(citem->state, LUA_GCSTEP, 2);
-        cache_entry *centry = NULL;
-        RDLOCK;
-        if (CF_RCHASH_OK == cf_rchash_get(centry_hash, (void *)citem->key, strlen(citem->key), (void *)&centry) ) {
-            UNLOCK;
-            as_logger_trace(mod_lua.logger, "[CACHE] found entry: %s (%d)", citem->key, centry->max_cache_size);
-            if (( CF_Q_SZ(centry->lua_state_q) < centry->max_cache_size ) 
-                && ( !strncmp(centry->gen, citem->gen, CACHE_ENTRY_GEN_MAX) )) {
-                cf_queue_push(centry->lua_state_q, &citem->state);
-                as_logger_trace(mod_lua.logger, "[CACHE] returning state: %s (%d)", citem->key, centry->max_cache_size);
+        if ( ctx->config.alloc_trim == true ) {
+            // Finish the cycle, so the slabs freed by the call are empty.
+            lua_gc(citem->state, LUA_GCCOLLECT, 0);
+            mod_lua_alloc_trim(citem->state);
+        }
+        else {
+            lua_gc(citem->state, LUA_GCSTEP, 2);
+        }
+        cache_sweep(ctx);
+        // The entry reserved by poll_state(). Once reinitialized or
+        // removed, its version no longer matches, and the state is closed.
+        cache_entry *centry = citem->centry;
+        if ( ctx->config.thread_cache_enabled == true && thread_cache_offer(citem) == 0 ) {
+            TRACE("[CACHE] returning thread state: %s", citem->key);
+        }
+        else if ( centry != NULL ) {
+            TRACE("[CACHE] found entry: %s (%d)", citem->key, cf_atomic32_get(centry->max_cache_size));
+            if (( citem->version == cf_atomic32_get(centry->version) )
+                && ( !strncmp(centry->gen, citem->gen, CACHE_ENTRY_GEN_MAX) )
+                && cache_entry_push(ctx, centry, citem->state)) {
+                TRACE("[CACHE] returning state: %s (%d)", citem->key, cf_atomic32_get(centry->max_cache_size));
                 citem->state = NULL;
             }
-            cf_rc_releaseandfree(centry);
-            centry = 0;
         }
         else {
-            UNLOCK;
-            as_logger_trace(mod_lua.logger, "[CACHE] entry not found: %s", citem->key);
+            TRACE("[CACHE] entry not found: %s", citem->key);
         }
     }
     else {
-        as_logger_trace(mod_lua.logger, "[CACHE] is disabled.");
+        TRACE("[CACHE] is disabled.");
+    }
+
+    if ( citem->centry != NULL ) {
+        cache_entry_release(citem->centry);
+        citem->centry = NULL;
     }
     
     // l is not NULL
     // This means that it was not returned to the cache.
     // So, we free it up.
     if ( citem->state != NULL) {
-        lua_close(citem->state);
-        as_logger_trace(mod_lua.logger, "[CACHE] state closed: %s", citem->key);
+        state_close(citem->state);
+        TRACE("[CACHE] state closed: %s", citem->key);
     }
 
     return 0;
@@ -679,7 +1670,7 @@ static int pushargs(lua_State * l, as_list * args) {
     };
 
     as_list_foreach(args, pushargs_foreach, &data);
-    as_logger_trace(mod_lua.logger, "pushargs: %d", data.count);
+    TRACE("pushargs: %d", data.count);
     return data.count;
 }
 
@@ -702,18 +1693,37 @@ static int handle_error(lua_State * l) {
     return 0;
 }
 
-static int apply(lua_State * l, int err, int argc, as_result * res) {
+static void stats_timer_start(stats_timer * timer, context * ctx, const char * filename, const char * function) {
+    timer->stats = ctx->config.stats_enabled ? mod_lua_stats_get(filename, function) : NULL;
+    timer->mark = timer->stats ? mod_lua_stats_now() : 0;
+}
+
+/**
+ * Record the time since the last lap against the phase.
+ */
+static inline void stats_timer_lap(stats_timer * timer, mod_lua_stats_phase phase) {
+    if ( timer->stats == NULL ) return;
+    uint64_t now = mod_lua_stats_now();
+    mod_lua_stats_latency(timer->stats, phase, now - timer->mark);
+    timer->mark = now;
+}
+
+static int apply(lua_State * l, int err, int argc, as_result * res, stats_timer * timer) {
 
-    as_logger_trace(mod_lua.logger, "apply");
+    TRACE("apply");
 
     // call apply_record(f, r, ...)
-    as_logger_trace(mod_lua.logger, "call function");
+    TRACE("call function");
     int rc = lua_pcall(l, argc, 1, err);
 
-    as_logger_trace(mod_lua.logger, "rc = %d", rc);
+    TRACE("rc = %d", rc);
+    stats_timer_lap(timer, MOD_LUA_STATS_CALL);
+    if ( timer->stats ) {
+        mod_lua_stats_call(timer->stats, rc != 0);
+    }
 
     // Convert the return value from a lua type to a val type
-    as_logger_trace(mod_lua.logger, "convert lua type to val");
+    TRACE("convert lua type to val");
 
 
     if ( rc == 0 ) {
@@ -730,10 +1740,11 @@ static int apply(lua_State * l, int err, int argc, as_result * res) {
     }
 
     // Pop the return value off the stack
-    as_logger_trace(mod_lua.logger, "pop return value from the stack");
+    TRACE("pop return value from the stack");
     lua_pop(l, -1);
+    stats_timer_lap(timer, MOD_LUA_STATS_RESULT);
 
-    return 0;
+    return rc;
 }
 
 static int verify_environment(context * ctx, as_aerospike * as) {
@@ -794,69 +1805,475 @@ static int apply_record(as_module * m, as_aerospike * as, const char * filename,
     cache_item  citem   = {
         .key    = "",
         .gen    = "",
+        .version = 0,
+        .centry = NULL,
         .state  = NULL
     };
 
     strncpy(citem.key, filename, CACHE_ENTRY_KEY_MAX);
     
-    as_logger_trace(mod_lua.logger, "apply_record: BEGIN");
+    TRACE("apply_record: BEGIN");
+
+    stats_timer timer;
+    stats_timer_start(&timer, ctx, filename, function);
 
     // lease a state
-    as_logger_trace(mod_lua.logger, "apply_record: poll state");
+    TRACE("apply_record: poll state");
     rc = poll_state(ctx, &citem);
     pthread_rwlock_unlock(ctx->lock);
+    stats_timer_lap(&timer, MOD_LUA_STATS_POLL);
 
     if ( rc != 0 ) {
-        as_logger_trace(mod_lua.logger, "apply_record: Unable to poll a state");
+        TRACE("apply_record: Unable to poll a state");
         return rc;
     }
 
     l = citem.state;
 
+    state_refs * refs = state_refs_get(l);
+
     // push error handler
     // lua_pushcfunction(l, handle_error);
     // int err = lua_gettop(l);
     
-    // push aerospike into the global scope
-    as_logger_trace(mod_lua.logger, "apply_record: push aerospike into the global scope");
-    mod_lua_pushaerospike(l, as);
-    lua_setglobal(l, "aerospike");
+    // bind aerospike to the global scope
+    TRACE("apply_record: bind aerospike to the global scope");
+    refs->aerospike->value = as;
     
     // push apply_record() onto the stack
-    as_logger_trace(mod_lua.logger, "apply_record: push apply_record() onto the stack");
-    lua_getglobal(l, "apply_record");
+    TRACE("apply_record: push apply_record() onto the stack");
+    lua_rawgeti(l, LUA_REGISTRYINDEX, refs->apply_record);
     
     // push function onto the stack
-    as_logger_trace(mod_lua.logger, "apply_record: push function onto the stack");
-    lua_getglobal(l, function);
+    TRACE("apply_record: push function onto the stack");
+    state_refs_pushfunction(l, refs, function);
 
     // push the record onto the stack
-    as_logger_trace(mod_lua.logger, "apply_record: push the record onto the stack");
+    TRACE("apply_record: push the record onto the stack");
     mod_lua_pushrecord(l, r);
 
     // push each argument onto the stack
-    as_logger_trace(mod_lua.logger, "apply_record: push each argument onto the stack");
+    TRACE("apply_record: push each argument onto the stack");
     argc = pushargs(l, args);
 
     // function + record + arglist
     argc = argc + 2;
     
+    stats_timer_lap(&timer, MOD_LUA_STATS_ARGS);
+
     // apply the function
-    as_logger_trace(mod_lua.logger, "apply_record: apply the function");
-    apply(l, err, argc, res);
+    TRACE("apply_record: apply the function");
+    apply(l, err, argc, res, &timer);
 
     // return the state
     pthread_rwlock_rdlock(ctx->lock);
-    as_logger_trace(mod_lua.logger, "apply_record: offer state");
+    TRACE("apply_record: offer state");
     offer_state(ctx, &citem);
     pthread_rwlock_unlock(ctx->lock);
+    stats_timer_lap(&timer, MOD_LUA_STATS_OFFER);
     
-    as_logger_trace(mod_lua.logger, "apply_record: END");
+    TRACE("apply_record: END");
+    return rc;
+}
+
+/**
+ * Applies a record function to a batch of records with a single lease.
+ *
+ * The dispatcher, function and arguments are pushed once, and copied
+ * with lua_pushvalue() for each record. lua_gc() is stepped every
+ * batch_gc_interval records, rather than after every record.
+ */
+int mod_lua_apply_record_batch(as_module * m, as_aerospike * as, const char * filename, const char * function, as_rec ** recs, uint32_t n, as_list * args, as_result * results) {
+
+    int         rc      = 0;
+    context *   ctx     = (context *) m->source;    // mod-lua context
+    lua_State * l       = (lua_State *) NULL;       // Lua State
+    int         argc    = 0;                        // Number of arguments pushed onto the stack
+
+    pthread_rwlock_rdlock(ctx->lock);
+    rc = verify_environment(ctx, as);
+    if ( rc ) {
+        pthread_rwlock_unlock(ctx->lock);
+        return rc;
+    }
+
+    cache_item  citem   = {
+        .key    = "",
+        .gen    = "",
+        .version = 0,
+        .centry = NULL,
+        .state  = NULL
+    };
+
+    strncpy(citem.key, filename, CACHE_ENTRY_KEY_MAX);
+
+    TRACE("apply_record_batch: BEGIN");
+
+    stats_timer timer;
+    stats_timer_start(&timer, ctx, filename, function);
+
+    // lease a state
+    rc = poll_state(ctx, &citem);
+    uint32_t interval = ctx->config.batch_gc_interval ? ctx->config.batch_gc_interval : BATCH_GC_INTERVAL;
+    pthread_rwlock_unlock(ctx->lock);
+    stats_timer_lap(&timer, MOD_LUA_STATS_POLL);
+
+    if ( rc != 0 ) {
+        TRACE("apply_record_batch: Unable to poll a state");
+        return rc;
+    }
+
+    l = citem.state;
+
+    state_refs * refs = state_refs_get(l);
+    refs->aerospike->value = as;
+
+    int base = lua_gettop(l);
+
+    // push apply_record(), the function and the arguments once
+    lua_rawgeti(l, LUA_REGISTRYINDEX, refs->apply_record);
+    state_refs_pushfunction(l, refs, function);
+    argc = pushargs(l, args);
+
+    int top = lua_gettop(l);
+    int dispatcher = base + 1;
+
+    for ( uint32_t i = 0; i < n; i++ ) {
+
+        lua_checkstack(l, argc + 3);
+
+        // apply_record() + function + record + arglist
+        lua_pushvalue(l, dispatcher);
+        lua_pushvalue(l, dispatcher + 1);
+        mod_lua_pushrecord(l, recs[i]);
+        for ( int a = dispatcher + 2; a <= top; a++ ) {
+            lua_pushvalue(l, a);
+        }
+        stats_timer_lap(&timer, MOD_LUA_STATS_ARGS);
+
+        // not apply(), which would clear the stack
+        int callrc = lua_pcall(l, argc + 2, 1, 0);
+        stats_timer_lap(&timer, MOD_LUA_STATS_CALL);
+        if ( timer.stats ) {
+            mod_lua_stats_call(timer.stats, callrc != 0);
+        }
+
+        if ( callrc == 0 ) {
+            as_result_setsuccess(&results[i], mod_lua_retval(l));
+        }
+        else {
+            as_result_setfailure(&results[i], mod_lua_retval(l));
+        }
+
+        lua_settop(l, top);
+        stats_timer_lap(&timer, MOD_LUA_STATS_RESULT);
+
+        if ( (i + 1) % interval == 0 ) {
+            lua_gc(l, LUA_GCSTEP, 2);
+        }
+    }
+
+    lua_settop(l, base);
+
+    // return the state
+    pthread_rwlock_rdlock(ctx->lock);
+    offer_state(ctx, &citem);
+    pthread_rwlock_unlock(ctx->lock);
+    stats_timer_lap(&timer, MOD_LUA_STATS_OFFER);
+
+    TRACE("apply_record_batch: END");
     return rc;
 }
 
 
 
+/**
+ * Reads the next value of a worker's partition, refilling its chunk from
+ * the job's input under the job lock.
+ */
+static as_val * stream_worker_read(const as_stream * s) {
+    stream_worker * w = (stream_worker *) as_stream_source(s);
+    stream_job * job = w->job;
+
+    if ( w->pos == w->count ) {
+        w->pos = 0;
+        w->count = 0;
+        pthread_mutex_lock(&job->lock);
+        while ( !job->end && w->count < STREAM_WORKER_CHUNK ) {
+            as_val * v = as_stream_read(job->istream);
+            if ( v == AS_STREAM_END ) {
+                job->end = true;
+                break;
+            }
+            w->chunk[w->count++] = v;
+        }
+        pthread_mutex_unlock(&job->lock);
+    }
+
+    if ( w->pos == w->count ) {
+        return AS_STREAM_END;
+    }
+    w->read = true;
+    return w->chunk[w->pos++];
+}
+
+static as_stream_status stream_worker_write(const as_stream * s, as_val * v) {
+    stream_worker * w = (stream_worker *) as_stream_source(s);
+    if ( v != AS_STREAM_END ) {
+        as_list_append(w->partials, v);
+    }
+    return AS_STREAM_OK;
+}
+
+static const as_stream_hooks stream_worker_istream_hooks = {
+    .destroy    = NULL,
+    .read       = stream_worker_read,
+    .write      = NULL
+};
+
+static const as_stream_hooks stream_worker_ostream_hooks = {
+    .destroy    = NULL,
+    .read       = NULL,
+    .write      = stream_worker_write
+};
+
+/**
+ * The partial results are owned by the workers, so they are read without
+ * a reference, like the values of any other input stream.
+ */
+static as_val * stream_merge_read(const as_stream * s) {
+    stream_merge * m = (stream_merge *) as_stream_source(s);
+    for ( ; m->i < m->n; m->i++, m->pos = 0 ) {
+        if ( m->skip && !m->workers[m->i].read ) {
+            continue;
+        }
+        as_list * partials = m->workers[m->i].partials;
+        if ( m->pos < as_list_size(partials) ) {
+            return as_list_get(partials, m->pos++);
+        }
+    }
+    return AS_STREAM_END;
+}
+
+static const as_stream_hooks stream_merge_hooks = {
+    .destroy    = NULL,
+    .read       = stream_merge_read,
+    .write      = NULL
+};
+
+/**
+ * Applies the function to the worker's partition, on a state of its own.
+ */
+static void stream_worker_apply(stream_worker * w, lua_State * l) {
+    stream_job *    job     = w->job;
+    state_refs *    refs    = state_refs_get(l);
+    stats_timer     timer   = { .stats = NULL, .mark = 0 };
+
+    refs->aerospike->value = job->as;
+
+    lua_rawgeti(l, LUA_REGISTRYINDEX, refs->handle_error);
+    int err = lua_gettop(l);
+
+    // apply_stream_partial() + function + istream + ostream + arglist
+    lua_rawgeti(l, LUA_REGISTRYINDEX, refs->apply_stream_partial);
+    state_refs_pushfunction(l, refs, job->function);
+    mod_lua_pushstream(l, &w->istream);
+    mod_lua_pushstream(l, &w->ostream);
+    int argc = 3 + pushargs(l, job->args);
+
+    int rc = apply(l, err, argc, NULL, &timer);
+    if ( rc != 0 ) {
+        pthread_mutex_lock(&job->lock);
+        if ( job->rc == 0 ) {
+            job->rc = rc;
+        }
+        pthread_mutex_unlock(&job->lock);
+    }
+}
+
+static void stream_job_leave(stream_job * job) {
+    pthread_mutex_lock(&job->lock);
+    if ( --job->running == 0 ) {
+        pthread_cond_signal(&job->done);
+    }
+    pthread_mutex_unlock(&job->lock);
+}
+
+/**
+ * Stream worker thread: leases a state for each queued partition, and
+ * applies the function to it. A partition that can not get a state is
+ * left to the other workers, which read the rest of the input.
+ */
+static void * stream_worker_thread(void * udata) {
+    context *       ctx = (context *) udata;
+    stream_worker * w   = NULL;
+
+    while ( cf_queue_pop(stream_q, &w, CF_QUEUE_FOREVER) == CF_QUEUE_OK ) {
+        stream_job * job = w->job;
+
+        cache_item  citem   = {
+            .key    = "",
+            .gen    = "",
+            .version = 0,
+            .centry = NULL,
+            .state  = NULL
+        };
+
+        strncpy(citem.key, job->filename, CACHE_ENTRY_KEY_MAX);
+
+        pthread_rwlock_rdlock(ctx->lock);
+        int rc = poll_state(ctx, &citem);
+        pthread_rwlock_unlock(ctx->lock);
+
+        if ( rc == 0 ) {
+            stream_worker_apply(w, citem.state);
+
+            pthread_rwlock_rdlock(ctx->lock);
+            offer_state(ctx, &citem);
+            pthread_rwlock_unlock(ctx->lock);
+        }
+
+        stream_job_leave(job);
+    }
+    return NULL;
+}
+
+/**
+ * Tests whether the function's stream ops can be partitioned: they can
+ * when the server ops end in a reduce, which merges the partial results.
+ */
+static bool stream_split(lua_State * l, state_refs * refs, const char * function, as_list * args) {
+    int top = lua_gettop(l);
+
+    lua_rawgeti(l, LUA_REGISTRYINDEX, refs->apply_stream_split);
+    state_refs_pushfunction(l, refs, function);
+    int argc = 1 + pushargs(l, args);
+
+    bool split = lua_pcall(l, argc, 1, 0) == 0 && lua_toboolean(l, -1);
+    lua_settop(l, top);
+    return split;
+}
+
+/**
+ * Applies the function to a stream partitioned across the stream workers,
+ * with the caller's state as the first worker, then merges the partial
+ * results on the caller's state, with the function's reduce.
+ *
+ * Only the order in which values are reduced differs from applying the
+ * function on one state, so the result is the same for an associative
+ * reduce. The values of istream must not depend on each other, since the
+ * workers hold several at a time. The function itself, which builds the
+ * stream ops, runs once more for each worker and for the merge, so side
+ * effects in its body repeat.
+ *
+ * A worker's error is logged by handle_error(). As its partition is lost,
+ * and the input is consumed, nothing is merged, and the error is returned.
+ *
+ * @return 0 on success, otherwise the error of the failed worker or merge
+ */
+static int apply_stream_parallel(context * ctx, lua_State * l, as_aerospike * as, const char * filename, const char * function, as_stream * istream, as_list * args, as_stream * ostream, stats_timer * timer) {
+
+    uint32_t n = ctx->config.stream_workers;
+    stream_worker * workers = (stream_worker *) malloc(sizeof(stream_worker) * n);
+    if ( workers == NULL ) {
+        as_logger_error(mod_lua.logger, "apply_stream: unable to allocate %d stream workers for %s.%s", n, filename, function);
+        return LUA_ERRMEM;
+    }
+
+    stream_job job = {
+        .ctx        = ctx,
+        .as         = as,
+        .filename   = filename,
+        .function   = function,
+        .args       = args,
+        .istream    = istream,
+        .end        = false,
+        .rc         = 0,
+        .running    = n
+    };
+
+    pthread_mutex_init(&job.lock, NULL);
+    pthread_cond_init(&job.done, NULL);
+
+    for ( uint32_t i = 0; i < n; i++ ) {
+        stream_worker * w = &workers[i];
+        w->job = &job;
+        w->partials = (as_list *) as_arraylist_new(4, 4);
+        w->read = false;
+        w->pos = 0;
+        w->count = 0;
+        as_stream_init(&w->istream, w, &stream_worker_istream_hooks);
+        as_stream_init(&w->ostream, w, &stream_worker_ostream_hooks);
+        if ( i > 0 ) {
+            cf_queue_push(stream_q, &w);
+        }
+    }
+
+    TRACE("apply_stream: partitioned across %d workers", n);
+    stats_timer_lap(timer, MOD_LUA_STATS_ARGS);
+
+    stream_worker_apply(&workers[0], l);
+    stream_job_leave(&job);
+
+    pthread_mutex_lock(&job.lock);
+    while ( job.running > 0 ) {
+        pthread_cond_wait(&job.done, &job.lock);
+    }
+    pthread_mutex_unlock(&job.lock);
+
+    int rc = job.rc;
+
+    if ( rc != 0 ) {
+        as_logger_error(mod_lua.logger, "apply_stream: %s.%s failed on a stream worker, its results are dropped", filename, function);
+    }
+    else {
+        bool read = false;
+        for ( uint32_t i = 0; i < n; i++ ) {
+            read = read || workers[i].read;
+        }
+
+        // A worker that read no values still passes on the initial value of
+        // an aggregate, which would be merged once more for each such worker.
+        // Their results are skipped, unless the input was empty, when the
+        // first worker's alone are merged, as a serial apply would pass them.
+        stream_merge merge = {
+            .workers    = workers,
+            .n          = read ? n : 1,
+            .skip       = read,
+            .i          = 0,
+            .pos        = 0
+        };
+
+        as_stream mstream;
+        as_stream_init(&mstream, &merge, &stream_merge_hooks);
+
+        state_refs * refs = state_refs_get(l);
+
+        lua_rawgeti(l, LUA_REGISTRYINDEX, refs->handle_error);
+        int err = lua_gettop(l);
+
+        // apply_stream_merge() + function + istream + ostream + arglist
+        lua_rawgeti(l, LUA_REGISTRYINDEX, refs->apply_stream_merge);
+        state_refs_pushfunction(l, refs, function);
+        mod_lua_pushstream(l, &mstream);
+        mod_lua_pushstream(l, ostream);
+        int argc = 3 + pushargs(l, args);
+
+        rc = apply(l, err, argc, NULL, timer);
+    }
+
+    for ( uint32_t i = 0; i < n; i++ ) {
+        as_list_destroy(workers[i].partials);
+    }
+    free(workers);
+
+    pthread_cond_destroy(&job.done);
+    pthread_mutex_destroy(&job.lock);
+
+    return rc;
+}
+
+
 /**
  * Applies function to a stream and set of arguments.
  *
@@ -869,7 +2286,8 @@ static int apply_record(as_module * m, as_aerospike * as, const char * filename,
  * @param s stream to apply to the function.
  * @param args list of arguments for the function represented as vals 
  * @param result pointer to a val that will be populated with the result.
- * @return 0 on success, otherwise 1
+ * @return 0 on success, otherwise the error of the function, whether it
+ *         was applied on one state or across the stream workers
  */
 static int apply_stream(as_module * m, as_aerospike * as, const char * filename, const char * function, as_stream * istream, as_list * args, as_stream * ostream) {
 
@@ -889,72 +2307,94 @@ static int apply_stream(as_module * m, as_aerospike * as, const char * filename,
     cache_item  citem   = {
         .key    = "",
         .gen    = "",
+        .version = 0,
+        .centry = NULL,
         .state  = NULL
     };
 
     strncpy(citem.key, filename, CACHE_ENTRY_KEY_MAX);
 
-    as_logger_trace(mod_lua.logger, "apply_stream: BEGIN");
+    TRACE("apply_stream: BEGIN");
+
+    stats_timer timer;
+    stats_timer_start(&timer, ctx, filename, function);
 
     // lease a state
-    as_logger_trace(mod_lua.logger, "apply_stream: poll state");
+    TRACE("apply_stream: poll state");
     rc = poll_state(ctx, &citem);
     pthread_rwlock_unlock(ctx->lock);
+    stats_timer_lap(&timer, MOD_LUA_STATS_POLL);
 
     if ( rc != 0 ) {
-        as_logger_trace(mod_lua.logger, "apply_stream: Unable to poll a state");
+        TRACE("apply_stream: Unable to poll a state");
         return rc;
     }
 
     l = citem.state;
 
+    state_refs * refs = state_refs_get(l);
+
+    // bind aerospike to the global scope
+    TRACE("apply_stream: bind aerospike to the global scope");
+    refs->aerospike->value = as;
+
+    if ( stream_q != NULL && ctx->config.server_mode && stream_split(l, refs, function, args) ) {
+        rc = apply_stream_parallel(ctx, l, as, filename, function, istream, args, ostream, &timer);
+
+        pthread_rwlock_rdlock(ctx->lock);
+        offer_state(ctx, &citem);
+        pthread_rwlock_unlock(ctx->lock);
+        stats_timer_lap(&timer, MOD_LUA_STATS_OFFER);
+
+        TRACE("apply_stream: END");
+        return rc;
+    }
+
     // push error handler
-    lua_pushcfunction(l, handle_error);
+    lua_rawgeti(l, LUA_REGISTRYINDEX, refs->handle_error);
     err = lua_gettop(l);
-    
-    // push aerospike into the global scope
-    as_logger_trace(mod_lua.logger, "apply_stream: push aerospike into the global scope");
-    mod_lua_pushaerospike(l, as);
-    lua_setglobal(l, "aerospike");
 
     // push apply_stream() onto the stack
-    as_logger_trace(mod_lua.logger, "apply_stream: push apply_stream() onto the stack");
-    lua_getglobal(l, "apply_stream");
+    TRACE("apply_stream: push apply_stream() onto the stack");
+    lua_rawgeti(l, LUA_REGISTRYINDEX, refs->apply_stream);
     
     // push function onto the stack
-    as_logger_trace(mod_lua.logger, "apply_stream: push function onto the stack");
-    lua_getglobal(l, function);
+    TRACE("apply_stream: push function onto the stack");
+    state_refs_pushfunction(l, refs, function);
 
     // push the stream onto the stack
     // if server_mode == true then SCOPE_SERVER(1) else SCOPE_CLIENT(2)
-    as_logger_trace(mod_lua.logger, "apply_stream: push scope onto the stack");
+    TRACE("apply_stream: push scope onto the stack");
     lua_pushinteger(l, ctx->config.server_mode ? 1 : 2);
 
     // push the stream onto the stack
-    as_logger_trace(mod_lua.logger, "apply_stream: push istream onto the stack");
+    TRACE("apply_stream: push istream onto the stack");
     mod_lua_pushstream(l, istream);
 
-    as_logger_trace(mod_lua.logger, "apply_stream: push ostream onto the stack");
+    TRACE("apply_stream: push ostream onto the stack");
     mod_lua_pushstream(l, ostream);
 
     // push each argument onto the stack
-    as_logger_trace(mod_lua.logger, "apply_stream: push each argument onto the stack");
+    TRACE("apply_stream: push each argument onto the stack");
     argc = pushargs(l, args); 
 
     // function + scope + istream + ostream + arglist
     argc = 4 + argc;
     
+    stats_timer_lap(&timer, MOD_LUA_STATS_ARGS);
+
     // call apply_stream(f, s, ...)
-    as_logger_trace(mod_lua.logger, "apply_stream: apply the function");
-    apply(l, err, argc, NULL);
+    TRACE("apply_stream: apply the function");
+    rc = apply(l, err, argc, NULL, &timer);
 
     // release the context
     pthread_rwlock_rdlock(ctx->lock);
-    as_logger_trace(mod_lua.logger, "apply_stream: lose the context");
+    TRACE("apply_stream: lose the context");
     offer_state(ctx, &citem);
     pthread_rwlock_unlock(ctx->lock);
+    stats_timer_lap(&timer, MOD_LUA_STATS_OFFER);
 
-    as_logger_trace(mod_lua.logger, "apply_stream: END");
+    TRACE("apply_stream: END");
     return rc;
 }
 
@@ -0,0 +1,342 @@
+/******************************************************************************
+ * Copyright 2008-2013 by Aerospike.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy 
+ * of this software and associated documentation files (the "Software"), to 
+ * deal in the Software without restriction, including without limitation the 
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or 
+ * sell copies of the Software, and to permit persons to whom the Software is 
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in 
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING 
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ *****************************************************************************/
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <citrusleaf/cf_atomic.h>
+
+#include <aerospike/as_memtracker.h>
+
+#include <aerospike/mod_lua_alloc.h>
+
+#include "internal.h"
+
+/*******************************************************************************
+ * MACROS
+ ******************************************************************************/
+
+// Slabs are aligned to their size, so a block's slab is found by masking.
+#define SLAB_SIZE (16 * 1024)
+#define SLAB_HEADER ((sizeof(slab) + 15) & ~((size_t) 15))
+
+// Block sizes are 16, 32, 64, 128, 256 and 512. Larger blocks are malloc'd.
+#define SLAB_CLASS_MIN 16
+#define SLAB_CLASSES 6
+#define SLAB_BLOCK_MAX (SLAB_CLASS_MIN << (SLAB_CLASSES - 1))
+
+/*******************************************************************************
+ * TYPES
+ ******************************************************************************/
+
+struct slab_s;
+typedef struct slab_s slab;
+
+struct arena_s;
+typedef struct arena_s arena;
+
+struct slab_s {
+	slab *			prev;
+	slab *			next;
+	void *			free;		// free blocks, linked through their first word
+	uint32_t		nfree;
+	uint32_t		nblocks;
+	uint32_t		cls;
+	bool			tracked;	// reserved with the memtracker
+};
+
+struct arena_s {
+	slab *			partial[SLAB_CLASSES];	// slabs with free blocks
+	uint32_t		nempty[SLAB_CLASSES];	// slabs with no blocks in use
+	as_memtracker *	mt;
+};
+
+/*******************************************************************************
+ * VARIABLES
+ ******************************************************************************/
+
+/**
+ * Bytes held by the slabs and large blocks of all arenas.
+ */
+static cf_atomic64 arena_memory = 0;
+
+/*******************************************************************************
+ * STATIC FUNCTIONS
+ ******************************************************************************/
+
+static inline int slab_class(size_t size) {
+	int cls = 0;
+	size_t block = SLAB_CLASS_MIN;
+	while ( block < size ) {
+		block <<= 1;
+		cls++;
+	}
+	return cls;
+}
+
+static inline bool arena_reserve(arena * a, size_t size) {
+	if ( a->mt != NULL && !as_memtracker_reserve(a->mt, (uint32_t) size) ) {
+		return false;
+	}
+	cf_atomic64_add(&arena_memory, size);
+	return true;
+}
+
+static inline void arena_release(arena * a, size_t size) {
+	if ( a->mt != NULL ) {
+		as_memtracker_release(a->mt, (uint32_t) size);
+	}
+	cf_atomic64_sub(&arena_memory, size);
+}
+
+static void slab_link(arena * a, slab * s) {
+	s->prev = NULL;
+	s->next = a->partial[s->cls];
+	if ( s->next ) s->next->prev = s;
+	a->partial[s->cls] = s;
+}
+
+static void slab_unlink(arena * a, slab * s) {
+	if ( s->prev ) s->prev->next = s->next;
+	else a->partial[s->cls] = s->next;
+	if ( s->next ) s->next->prev = s->prev;
+	s->prev = s->next = NULL;
+}
+
+/**
+ * A slab for a shrink is made even if the memtracker refuses it, as Lua
+ * requires shrinks to succeed. It is then only counted in arena_memory.
+ */
+static slab * slab_new(arena * a, int cls, bool shrink) {
+	void * mem = NULL;
+	bool tracked = arena_reserve(a, SLAB_SIZE);
+	if ( !tracked ) {
+		if ( !shrink ) {
+			return NULL;
+		}
+		cf_atomic64_add(&arena_memory, SLAB_SIZE);
+	}
+	if ( posix_memalign(&mem, SLAB_SIZE, SLAB_SIZE) != 0 ) {
+		if ( tracked ) arena_release(a, SLAB_SIZE);
+		else cf_atomic64_sub(&arena_memory, SLAB_SIZE);
+		return NULL;
+	}
+
+	slab * s = (slab *) mem;
+	size_t block = SLAB_CLASS_MIN << cls;
+	char * p = (char *) mem + SLAB_HEADER;
+	char * end = (char *) mem + SLAB_SIZE;
+
+	s->cls = cls;
+	s->tracked = tracked;
+	s->nblocks = 0;
+	s->free = NULL;
+	for ( ; p + block <= end; p += block ) {
+		*(void **) p = s->free;
+		s->free = p;
+		s->nblocks++;
+	}
+	s->nfree = s->nblocks;
+
+	slab_link(a, s);
+	a->nempty[cls]++;
+	return s;
+}
+
+static void slab_destroy(arena * a, slab * s) {
+	slab_unlink(a, s);
+	a->nempty[s->cls]--;
+	bool tracked = s->tracked;
+	free(s);
+	if ( tracked ) arena_release(a, SLAB_SIZE);
+	else cf_atomic64_sub(&arena_memory, SLAB_SIZE);
+}
+
+static void * block_alloc(arena * a, size_t size, bool shrink) {
+	if ( size > SLAB_BLOCK_MAX ) {
+		if ( !arena_reserve(a, size) ) {
+			return NULL;
+		}
+		void * p = malloc(size);
+		if ( p == NULL ) {
+			arena_release(a, size);
+		}
+		return p;
+	}
+
+	int cls = slab_class(size);
+	slab * s = a->partial[cls];
+	if ( s == NULL && (s = slab_new(a, cls, shrink)) == NULL ) {
+		return NULL;
+	}
+	if ( s->nfree == s->nblocks ) {
+		a->nempty[cls]--;
+	}
+
+	void * p = s->free;
+	s->free = *(void **) p;
+	s->nfree--;
+	if ( s->nfree == 0 ) {
+		slab_unlink(a, s);
+	}
+	return p;
+}
+
+/**
+ * A slab block goes back to the slab it is in, whatever its size class,
+ * so only the large/small boundary depends on the size Lua passes.
+ */
+static void block_free(arena * a, void * p, size_t size) {
+	if ( size > SLAB_BLOCK_MAX ) {
+		free(p);
+		arena_release(a, size);
+		return;
+	}
+
+	slab * s = (slab *) ((uintptr_t) p & ~((uintptr_t) SLAB_SIZE - 1));
+	*(void **) p = s->free;
+	s->free = p;
+	if ( s->nfree++ == 0 ) {
+		slab_link(a, s);
+	}
+	if ( s->nfree == s->nblocks ) {
+		// keep one empty slab per class, to avoid churning on a boundary
+		a->nempty[s->cls]++;
+		if ( a->nempty[s->cls] > 1 ) {
+			slab_destroy(a, s);
+		}
+	}
+}
+
+static void arena_destroy(arena * a) {
+	for ( int i = 0; i < SLAB_CLASSES; i++ ) {
+		while ( a->partial[i] ) slab_destroy(a, a->partial[i]);
+	}
+	free(a);
+}
+
+/**
+ * The lua_Alloc. Lua passes the block's size on every realloc and free,
+ * so blocks need no header.
+ */
+static void * arena_alloc(void * ud, void * ptr, size_t osize, size_t nsize) {
+	arena * a = (arena *) ud;
+
+	if ( nsize == 0 ) {
+		if ( ptr ) block_free(a, ptr, osize);
+		return NULL;
+	}
+
+	if ( ptr == NULL ) {
+		return block_alloc(a, nsize, false);
+	}
+
+	if ( osize > SLAB_BLOCK_MAX && nsize > SLAB_BLOCK_MAX ) {
+		if ( nsize > osize && !arena_reserve(a, nsize - osize) ) {
+			return NULL;
+		}
+		void * p = realloc(ptr, nsize);
+		if ( p == NULL ) {
+			if ( nsize > osize ) {
+				arena_release(a, nsize - osize);
+				return NULL;
+			}
+			// Lua expects shrinking to succeed, the old block still fits
+			return ptr;
+		}
+		if ( nsize < osize ) {
+			arena_release(a, osize - nsize);
+		}
+		return p;
+	}
+
+	if ( osize <= SLAB_BLOCK_MAX && nsize <= SLAB_BLOCK_MAX && slab_class(osize) == slab_class(nsize) ) {
+		return ptr;
+	}
+
+	// A shrink moves the block rather than keep ptr, as Lua frees it by
+	// its new size, and a large block freed as a slab block corrupts the
+	// heap. It fails only when malloc does, leaving ptr to Lua as it was.
+	void * p = block_alloc(a, nsize, nsize < osize);
+	if ( p == NULL ) {
+		return NULL;
+	}
+	memcpy(p, ptr, osize < nsize ? osize : nsize);
+	block_free(a, ptr, osize);
+	return p;
+}
+
+/*******************************************************************************
+ * FUNCTIONS
+ ******************************************************************************/
+
+lua_State * mod_lua_alloc_newstate(as_memtracker * mt) {
+	arena * a = (arena *) calloc(1, sizeof(arena));
+	if ( a == NULL ) {
+		return NULL;
+	}
+	a->mt = mt;
+
+	lua_State * l = lua_newstate(arena_alloc, a);
+	if ( l == NULL ) {
+		arena_destroy(a);
+	}
+	return l;
+}
+
+void mod_lua_alloc_close(lua_State * l) {
+	void * ud = NULL;
+	lua_Alloc f = lua_getallocf(l, &ud);
+
+	lua_close(l);
+
+	if ( f != arena_alloc ) {
+		return;
+	}
+
+	// every block was freed by lua_close(), leaving only empty slabs
+	arena_destroy((arena *) ud);
+}
+
+void mod_lua_alloc_trim(lua_State * l) {
+	void * ud = NULL;
+	if ( l == NULL || lua_getallocf(l, &ud) != arena_alloc ) {
+		return;
+	}
+
+	arena * a = (arena *) ud;
+	for ( int i = 0; i < SLAB_CLASSES; i++ ) {
+		if ( a->nempty[i] == 0 ) continue;
+		slab * s = a->partial[i];
+		while ( s ) {
+			slab * next = s->next;
+			if ( s->nfree == s->nblocks ) slab_destroy(a, s);
+			s = next;
+		}
+	}
+}
+
+uint64_t mod_lua_alloc_memory() {
+	return cf_atomic64_get(arena_memory);
+}
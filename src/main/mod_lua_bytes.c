@@ -26,10 +26,13 @@
 #include <stdint.h>
 #include <stdbool.h>
 
+#include <aerospike/as_arraylist.h>
+#include <aerospike/as_list.h>
 #include <aerospike/as_val.h>
 
 #include <aerospike/mod_lua_val.h>
 #include <aerospike/mod_lua_bytes.h>
+#include <aerospike/mod_lua_list.h>
 #include <aerospike/mod_lua_iterator.h>
 #include <aerospike/mod_lua_reg.h>
 
@@ -44,15 +47,105 @@
 #define OBJECT_NAME "bytes"
 #define CLASS_NAME  "Bytes"
 
+/*******************************************************************************
+ * TYPES
+ ******************************************************************************/
+
+/**
+ *	A view is a Bytes box whose as_bytes wraps a window of a parent 
+ *	as_bytes, which the view reserves, instead of a copy of it. The window
+ *	is re-read from the parent on each access, so it stays valid when the
+ *	parent is resized. A view is copied into a buffer of its own when it
+ *	is mutated, or stored.
+ */
+typedef struct {
+	mod_lua_box		box;
+	as_bytes *		parent;
+	uint32_t		offset;
+	uint32_t		length;
+} mod_lua_bytes_view;
+
 /*******************************************************************************
  * BOX FUNCTIONS
  ******************************************************************************/
 
+/**
+ *	The view at index, or NULL if it is not a view, or no longer one.
+ *	A view is Bytes of the size of a view, so other userdata of that size
+ *	is never read as one.
+ */
+static mod_lua_bytes_view * mod_lua_bytes_toview(lua_State * l, int index) {
+	if ( lua_type(l, index) != LUA_TUSERDATA || lua_objlen(l, index) != sizeof(mod_lua_bytes_view) ) {
+		return NULL;
+	}
+	if ( !lua_getmetatable(l, index) ) {
+		return NULL;
+	}
+	luaL_getmetatable(l, CLASS_NAME);
+	int bytes = lua_rawequal(l, -1, -2);
+	lua_pop(l, 2);
+	if ( !bytes ) {
+		return NULL;
+	}
+	mod_lua_bytes_view * view = (mod_lua_bytes_view *) lua_touserdata(l, index);
+	return view->parent ? view : NULL;
+}
+
+/**
+ *	Points the as_bytes of a view at its window of the parent.
+ */
+static as_bytes * mod_lua_bytes_window(mod_lua_bytes_view * view) {
+	as_bytes *	b = (as_bytes *) view->box.value;
+	as_bytes *	p = view->parent;
+	uint32_t	offset = view->offset < p->size ? view->offset : p->size;
+	uint32_t	size = p->size - offset < view->length ? p->size - offset : view->length;
+
+	b->value = p->value ? p->value + offset : NULL;
+	b->size = size;
+	b->capacity = size;
+	return b;
+}
+
+/**
+ *	Copies the window of a view into a buffer of its own, and releases the
+ *	parent. From then on the view is plain bytes.
+ */
+static bool mod_lua_bytes_copy(mod_lua_bytes_view * view) {
+	as_bytes *	b = mod_lua_bytes_window(view);
+	uint8_t *	raw = NULL;
+
+	if ( b->size > 0 ) {
+		raw = (uint8_t *) malloc(b->size);
+		if ( !raw ) {
+			return false;
+		}
+		memcpy(raw, b->value, b->size);
+	}
+
+	b->value = raw;
+	b->free = true;
+	as_val_destroy(view->parent);
+	view->parent = NULL;
+	return true;
+}
+
 as_bytes * mod_lua_tobytes(lua_State * l, int index) {
+	mod_lua_bytes_view * view = mod_lua_bytes_toview(l, index);
+	if ( view ) {
+		return mod_lua_bytes_window(view);
+	}
 	mod_lua_box * box = mod_lua_tobox(l, index, CLASS_NAME);
 	return (as_bytes *) mod_lua_box_value(box);
 }
 
+as_bytes * mod_lua_ownbytes(lua_State * l, int index) {
+	mod_lua_bytes_view * view = mod_lua_bytes_toview(l, index);
+	if ( view && !mod_lua_bytes_copy(view) ) {
+		return NULL;
+	}
+	return mod_lua_tobytes(l, index);
+}
+
 as_bytes * mod_lua_pushbytes(lua_State * l, as_bytes * b) {
 	mod_lua_box * box = mod_lua_pushbox(l, MOD_LUA_SCOPE_LUA, b, CLASS_NAME);
 	return (as_bytes *) mod_lua_box_value(box);
@@ -60,11 +153,29 @@ as_bytes * mod_lua_pushbytes(lua_State * l, as_bytes * b) {
 
 static as_bytes * mod_lua_checkbytes(lua_State * l, int index) {
 	mod_lua_box * box = mod_lua_checkbox(l, index, CLASS_NAME);
+	mod_lua_bytes_view * view = mod_lua_bytes_toview(l, index);
+	if ( view ) {
+		return mod_lua_bytes_window(view);
+	}
 	return (as_bytes *) mod_lua_box_value(box);
 }
 
+/**
+ *	As mod_lua_checkbytes(), for functions that mutate the bytes, which
+ *	first copies a view out of its parent.
+ */
+static as_bytes * mod_lua_writebytes(lua_State * l, int index) {
+	mod_lua_checkbox(l, index, CLASS_NAME);
+	return mod_lua_ownbytes(l, index);
+}
+
 static int mod_lua_bytes_gc(lua_State * l) {
+	mod_lua_bytes_view * view = mod_lua_bytes_toview(l, 1);
 	mod_lua_freebox(l, 1, CLASS_NAME);
+	if ( view ) {
+		as_val_destroy(view->parent);
+		view->parent = NULL;
+	}
 	return 0;
 }
 
@@ -122,7 +233,7 @@ static int mod_lua_bytes_ensure(lua_State *l)
 		return 1;
 	}
 
-	as_bytes * 	b = mod_lua_checkbytes(l, 1);
+	as_bytes * 	b = mod_lua_writebytes(l, 1);
 	lua_Integer c = luaL_optinteger(l, 2, 0);
 	int 		r = luaL_optint(l, 3, 0);
 
@@ -149,7 +260,7 @@ static int mod_lua_bytes_truncate(lua_State *l)
 		return 1;
 	}
 
-	as_bytes * 	b = mod_lua_checkbytes(l, 1);
+	as_bytes * 	b = mod_lua_writebytes(l, 1);
 	lua_Integer n = luaL_optinteger(l, 2, 0);
 
 	// check preconditions:
@@ -198,8 +309,7 @@ static int mod_lua_bytes_tostring(lua_State * l)
 		return 1;
 	}
 
-	mod_lua_box *   box = mod_lua_checkbox(l, 1, CLASS_NAME);
-	as_val *        val = mod_lua_box_value(box);
+	as_val *        val = (as_val *) mod_lua_checkbytes(l, 1);
 	char *          str = NULL;
 
 	if ( val ) {
@@ -259,7 +369,7 @@ static int mod_lua_bytes_set_type(lua_State * l)
 		return 1;
 	}
 
-	as_bytes * 	b = mod_lua_checkbytes(l, 1);
+	as_bytes * 	b = mod_lua_writebytes(l, 1);
 	lua_Integer t = luaL_optinteger(l, 2, 0);
 
 	// check preconditions:
@@ -297,7 +407,7 @@ static int mod_lua_bytes_append_byte(lua_State * l)
 		return 1;
 	}
 
-	as_bytes * 	b = mod_lua_checkbytes(l, 1);
+	as_bytes * 	b = mod_lua_writebytes(l, 1);
 	lua_Integer v = luaL_optinteger(l, 2, 0);
 
 	// check preconditions:
@@ -344,7 +454,7 @@ static int mod_lua_bytes_append_int16(lua_State * l)
 		return 1;
 	}
 
-	as_bytes * 	b = mod_lua_checkbytes(l, 1);
+	as_bytes * 	b = mod_lua_writebytes(l, 1);
 	lua_Integer v = luaL_optinteger(l, 2, 0);
 
 	// check preconditions:
@@ -391,7 +501,7 @@ static int mod_lua_bytes_append_int32(lua_State * l)
 		return 1;
 	}
 
-	as_bytes * 	b = mod_lua_checkbytes(l, 1);
+	as_bytes * 	b = mod_lua_writebytes(l, 1);
 	lua_Integer	v = luaL_optinteger(l, 2, 0);
 
 	// check preconditions:
@@ -438,7 +548,7 @@ static int mod_lua_bytes_append_int64(lua_State * l)
 		return 1;
 	}
 
-	as_bytes * 	b = mod_lua_checkbytes(l, 1);
+	as_bytes * 	b = mod_lua_writebytes(l, 1);
 	lua_Integer v = luaL_optinteger(l, 2, 0); 
 
 	// check preconditions:
@@ -485,7 +595,7 @@ static int mod_lua_bytes_append_string(lua_State * l)
 		return 1;
 	}
 
-	as_bytes * 		b = mod_lua_checkbytes(l, 1);
+	as_bytes * 		b = mod_lua_writebytes(l, 1);
 	size_t  		n = 0;
 	const char *	v = luaL_optlstring(l, 2, NULL, &n);
 
@@ -533,7 +643,7 @@ static int mod_lua_bytes_append_bytes(lua_State * l)
 		return 1;
 	}
 
-	as_bytes * 	b = mod_lua_checkbytes(l, 1);
+	as_bytes * 	b = mod_lua_writebytes(l, 1);
 	as_bytes * 	v = mod_lua_checkbytes(l, 2);
 	lua_Integer	n = luaL_optinteger(l, 3, 0); 
 
@@ -554,6 +664,8 @@ static int mod_lua_bytes_append_bytes(lua_State * l)
 
 	// ensure we have capacity, if not, then resize
 	if ( as_bytes_ensure(b, pos + size, true) == true ) {
+		// v may be a view of b, so re-read its window after the resize
+		v = mod_lua_checkbytes(l, 2);
 		// write the bytes
 		res = as_bytes_append(b, (uint8_t *) v->value, size);
 	}
@@ -587,7 +699,7 @@ static int mod_lua_bytes_set_byte(lua_State * l)
 		return 1;
 	}
 
-	as_bytes * 	b = mod_lua_checkbytes(l, 1);
+	as_bytes * 	b = mod_lua_writebytes(l, 1);
 	lua_Integer i = luaL_optinteger(l, 2, 0); 
 	lua_Integer v = luaL_optinteger(l, 3, 0); 
 
@@ -638,7 +750,7 @@ static int mod_lua_bytes_set_int16(lua_State * l)
 		return 1;
 	}
 
-	as_bytes * 	b = mod_lua_checkbytes(l, 1);
+	as_bytes * 	b = mod_lua_writebytes(l, 1);
 	lua_Integer	i = luaL_optinteger(l, 2, 0); 
 	lua_Integer	v = luaL_optinteger(l, 3, 0); 
 
@@ -689,7 +801,7 @@ static int mod_lua_bytes_set_int32(lua_State * l)
 		return 1;
 	}
 
-	as_bytes * 	b = mod_lua_checkbytes(l, 1);
+	as_bytes * 	b = mod_lua_writebytes(l, 1);
 	lua_Integer	i = luaL_optinteger(l, 2, 0); 
 	lua_Integer	v = luaL_optinteger(l, 3, 0);
 
@@ -740,7 +852,7 @@ static int mod_lua_bytes_set_int64(lua_State * l)
 		return 1;
 	}
 
-	as_bytes * 	b = mod_lua_checkbytes(l, 1);
+	as_bytes * 	b = mod_lua_writebytes(l, 1);
 	lua_Integer	i = luaL_optinteger(l, 2, 0); 
 	lua_Integer	v = luaL_optinteger(l, 3, 0); 
 
@@ -791,7 +903,7 @@ static int mod_lua_bytes_set_string(lua_State * l)
 		return 1;
 	}
 
-	as_bytes * 		b = mod_lua_checkbytes(l, 1);
+	as_bytes * 		b = mod_lua_writebytes(l, 1);
 	lua_Integer 	i = luaL_optinteger(l, 2, 0); 
 	size_t  		n = 0;
 	const char *	v = luaL_optlstring(l, 3, NULL, &n);
@@ -843,7 +955,7 @@ static int mod_lua_bytes_set_bytes(lua_State * l)
 		return 1;
 	}
 
-	as_bytes * 	b = mod_lua_checkbytes(l, 1);
+	as_bytes * 	b = mod_lua_writebytes(l, 1);
 	lua_Integer	i = luaL_optinteger(l, 2, 0); 
 	as_bytes * 	v = mod_lua_checkbytes(l, 3);
 	lua_Integer	n = luaL_optinteger(l, 4, 0); 
@@ -867,6 +979,8 @@ static int mod_lua_bytes_set_bytes(lua_State * l)
 
 	// ensure we have capacity, if not, then resize
 	if ( as_bytes_ensure(b, pos + size, true) == true ) {
+		// v may be a view of b, so re-read its window after the resize
+		v = mod_lua_checkbytes(l, 3);
 		// write the bytes
 		res = as_bytes_set(b, pos, (uint8_t *) v->value, (uint32_t) n);
 	}
@@ -1157,6 +1271,206 @@ static int mod_lua_bytes_get_bytes(lua_State * l)
 	return 1;
 }
 
+/******************************************************************************
+ *	FIXED WIDTH FUNCTIONS
+ *****************************************************************************/
+
+/**
+ *	Split bytes into entries of `n` bytes each, copied into a list of
+ *	bytes in a single call.
+ *	
+ *	----------{.c}
+ *	list bytes.split_fixed(bytes b, uint32 n [, uint32 count [, bool reverse]])
+ *	----------
+ *	
+ *	@param b 		The bytes to split.
+ *	@param n		The size of each entry.
+ *	@param count	The number of entries to copy. Defaults to all of them.
+ *	@param reverse	If true, start from the last entry and move toward the 
+ *					first, for LIFO reads.
+ *	
+ *	@return On success, the list of entries. Otherwise nil on failure.
+ */
+static int mod_lua_bytes_split_fixed(lua_State * l)
+{
+	as_bytes *	b = mod_lua_checkbytes(l, 1);
+	lua_Integer	n = luaL_optinteger(l, 2, 0);
+	lua_Integer	count = luaL_optinteger(l, 3, -1);
+	bool		reverse = lua_toboolean(l, 4);
+
+	// check preconditions:
+	//	- b != NULL
+	//	- 1 <= n <= UINT32_MAX
+	if ( !b || 
+		 n < 1 || n > UINT32_MAX ) {
+		return 0;
+	}
+
+	uint32_t size = (uint32_t) n;
+	uint32_t total = b->size / size;
+	uint32_t entries = count >= 0 && count < total ? (uint32_t) count : total;
+
+	as_arraylist * list = as_arraylist_new(entries ? entries : 1, 8);
+
+	for ( uint32_t i = 0; i < entries; i++ ) {
+		uint32_t e = reverse ? total - 1 - i : i;
+		uint8_t * raw = (uint8_t *) malloc(size);
+
+		if ( !raw ) {
+			break;
+		}
+
+		memcpy(raw, b->value + ((size_t) e * size), size);
+		as_arraylist_append(list, (as_val *) as_bytes_new_wrap(raw, size, true));
+	}
+
+	mod_lua_pushlist(l, (as_list *) list);
+	return 1;
+}
+
+/**
+ *	Append the bytes in a list to bytes as entries of `n` bytes each. A
+ *	shorter value is padded with zeros, and a longer one is cut to `n`.
+ *	
+ *	----------{.c}
+ *	uint32 bytes.append_fixed(bytes b, list v, uint32 n [, uint32 i [, uint32 count]])
+ *	----------
+ *	
+ *	@param b 		The bytes to append to.
+ *	@param v		The list of bytes to append.
+ *	@param n		The size of each entry.
+ *	@param i		The index in v of the first value. Defaults to 1.
+ *	@param count	The number of values to append. Defaults to the rest.
+ *	
+ *	@return The number of entries appended, which stops at the first value
+ *			that is not bytes. Otherwise nil on failure.
+ */
+static int mod_lua_bytes_append_fixed(lua_State * l)
+{
+	as_bytes *	b = mod_lua_writebytes(l, 1);
+	as_list *	v = mod_lua_tolist(l, 2);
+	lua_Integer	n = luaL_optinteger(l, 3, 0);
+	lua_Integer	i = luaL_optinteger(l, 4, 1);
+	lua_Integer	count = luaL_optinteger(l, 5, -1);
+
+	// check preconditions:
+	//	- b != NULL
+	//	- v != NULL
+	//	- 1 <= n <= UINT32_MAX
+	//	- 1 <= i
+	if ( !b || 
+		 !v ||
+		 n < 1 || n > UINT32_MAX ||
+		 i < 1 ) {
+		return 0;
+	}
+
+	uint32_t size = (uint32_t) n;
+	uint32_t first = (uint32_t) i - 1;
+	uint32_t last = as_list_size(v);
+	uint32_t entries = first < last ? last - first : 0;
+
+	if ( count >= 0 && count < entries ) {
+		entries = (uint32_t) count;
+	}
+
+	if ( (uint64_t) b->size + (uint64_t) entries * size > UINT32_MAX ||
+		 as_bytes_ensure(b, b->size + entries * size, true) == false ) {
+		return 0;
+	}
+
+	uint32_t appended = 0;
+	for ( ; appended < entries; appended++ ) {
+		as_bytes * e = (as_bytes *) as_list_get(v, first + appended);
+
+		if ( !e || as_val_type(e) != AS_BYTES ) {
+			break;
+		}
+
+		uint32_t len = e->size < size ? e->size : size;
+		memcpy(b->value + b->size, e->value, len);
+		memset(b->value + b->size + len, 0, size - len);
+		b->size += size;
+	}
+
+	lua_pushinteger(l, appended);
+	return 1;
+}
+
+/**
+ *	A view of `n` bytes of b from index i, which shares the buffer of b 
+ *	instead of copying it. Reading a view never allocates. A view is 
+ *	copied into its own buffer when it is mutated, or stored in a bin, 
+ *	list or map. If v is a view, it is moved to the new window and 
+ *	returned, so a scan can reuse a single view.
+ *	
+ *	----------{.c}
+ *	bytes bytes.view(bytes b, uint32 i, uint32 n [, bytes v])
+ *	----------
+ *	
+ *	@param b 	The bytes to view.
+ *	@param i	The index in b of the first byte of the view.
+ *	@param n	The length of the view. It is cut to the end of b.
+ *	@param v	A view to reuse.
+ *	
+ *	@return On success, the view. Otherwise nil on failure.
+ */
+static int mod_lua_bytes_newview(lua_State * l)
+{
+	as_bytes *	b = mod_lua_checkbytes(l, 1);
+	lua_Integer	i = luaL_optinteger(l, 2, 0);
+	lua_Integer	n = luaL_optinteger(l, 3, 0);
+
+	// check preconditions:
+	//	- b != NULL
+	//	- 1 <= i <= UINT32_MAX
+	//	- 0 <= n <= UINT32_MAX
+	if ( !b || 
+		 i < 1 || i > UINT32_MAX ||
+		 n < 0 || n > UINT32_MAX ) {
+		return 0;
+	}
+
+	// a view of a view is a view of its parent
+	mod_lua_bytes_view *	of = mod_lua_bytes_toview(l, 1);
+	as_bytes *				parent = of ? of->parent : b;
+	uint64_t				offset = (uint64_t) (of ? of->offset : 0) + (i - 1);
+
+	if ( offset > UINT32_MAX ) {
+		offset = UINT32_MAX;
+	}
+
+	mod_lua_bytes_view * view = lua_gettop(l) >= 4 ? mod_lua_bytes_toview(l, 4) : NULL;
+
+	if ( view ) {
+		// reserve before release, as the parent may not change
+		as_val_reserve(parent);
+		as_val_destroy(view->parent);
+		view->parent = parent;
+		lua_settop(l, 4);
+	}
+	else {
+		as_bytes * wrap = as_bytes_new_wrap(NULL, 0, false);
+
+		if ( !wrap ) {
+			return 0;
+		}
+
+		view = (mod_lua_bytes_view *) lua_newuserdata(l, sizeof(mod_lua_bytes_view));
+		view->box.scope = MOD_LUA_SCOPE_LUA;
+		view->box.value = wrap;
+		view->parent = parent;
+		as_val_reserve(parent);
+		luaL_getmetatable(l, CLASS_NAME);
+		lua_setmetatable(l, -2);
+	}
+
+	view->offset = (uint32_t) offset;
+	view->length = (uint32_t) n;
+	mod_lua_bytes_window(view);
+	return 1;
+}
+
 /******************************************************************************
  * OBJECT TABLE
  *****************************************************************************/
@@ -1198,6 +1512,10 @@ static const luaL_reg bytes_object_table[] = {
 	{"get_int32",		mod_lua_bytes_get_int32},
 	{"get_int64",		mod_lua_bytes_get_int64},
 
+	{"view",			mod_lua_bytes_newview},
+	{"split_fixed",		mod_lua_bytes_split_fixed},
+	{"append_fixed",	mod_lua_bytes_append_fixed},
+
 	{"ensure",			mod_lua_bytes_ensure},
 	{"truncate",		mod_lua_bytes_ensure},
 	
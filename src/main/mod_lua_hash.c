@@ -0,0 +1,340 @@
+/******************************************************************************
+ * Copyright 2008-2013 by Aerospike.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy 
+ * of this software and associated documentation files (the "Software"), to 
+ * deal in the Software without restriction, including without limitation the 
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or 
+ * sell copies of the Software, and to permit persons to whom the Software is 
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in 
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING 
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ *****************************************************************************/
+
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#endif
+
+#include <aerospike/as_bytes.h>
+#include <aerospike/as_string.h>
+#include <aerospike/as_val.h>
+
+#include <aerospike/mod_lua_val.h>
+#include <aerospike/mod_lua_bytes.h>
+#include <aerospike/mod_lua_hash.h>
+#include <aerospike/mod_lua_string.h>
+#include <aerospike/mod_lua_reg.h>
+
+#include "internal.h"
+
+/*******************************************************************************
+ * MACROS
+ ******************************************************************************/
+
+#define OBJECT_NAME "hash"
+
+// CRC-32 (MSB first), as in CRC32.lua
+#define CRC32_POLY  0x04C11DB7
+
+// CRC32C (reflected), as in the SSE4.2 crc32 instruction
+#define CRC32C_POLY 0x82F63B78
+
+#define HASH64_M    0xc6a4a7935bd1e995ULL
+#define HASH64_R    47
+
+/*******************************************************************************
+ * TYPES
+ ******************************************************************************/
+
+typedef union {
+    int64_t     i;
+    double      d;
+} hash_number;
+
+/*******************************************************************************
+ * VARIABLES
+ ******************************************************************************/
+
+static pthread_once_t hash_once = PTHREAD_ONCE_INIT;
+
+static uint32_t crc32_table[256];
+
+static uint32_t crc32c_table[256];
+
+static bool crc32c_sse42 = false;
+
+/*******************************************************************************
+ * FUNCTIONS
+ ******************************************************************************/
+
+static void hash_init() {
+    for ( uint32_t i = 0; i < 256; i++ ) {
+        uint32_t c = i << 24;
+        for ( int k = 0; k < 8; k++ ) {
+            c = (c & 0x80000000) ? (c << 1) ^ CRC32_POLY : c << 1;
+        }
+        crc32_table[i] = c;
+
+        c = i;
+        for ( int k = 0; k < 8; k++ ) {
+            c = (c & 1) ? (c >> 1) ^ CRC32C_POLY : c >> 1;
+        }
+        crc32c_table[i] = c;
+    }
+
+#if defined(__x86_64__) || defined(__i386__)
+    unsigned int eax, ebx, ecx, edx;
+    if ( __get_cpuid(1, &eax, &ebx, &ecx, &edx) ) {
+        crc32c_sse42 = (ecx & bit_SSE4_2) != 0;
+    }
+#endif
+}
+
+/**
+ * The CRC-32 computed by CRC32.Hash(): no reflection and no final xor,
+ * so existing lsets keep their bins.
+ */
+static uint32_t hash_crc32(const uint8_t * p, size_t len) {
+    uint32_t crc = 0xFFFFFFFF;
+    while ( len-- ) {
+        crc = (crc << 8) ^ crc32_table[(crc >> 24) ^ *p++];
+    }
+    return crc;
+}
+
+#if defined(__x86_64__)
+/**
+ * The crc32 instruction, 8 bytes at a time. It is written in asm so the
+ * module still builds with -march values that lack SSE4.2; it is only
+ * called when cpuid reports it.
+ */
+static uint32_t hash_crc32c_sse42(uint32_t crc, const uint8_t * p, size_t len) {
+    uint64_t c = crc;
+    for ( ; len >= 8; p += 8, len -= 8 ) {
+        uint64_t w;
+        memcpy(&w, p, 8);
+        __asm__("crc32q %1, %0" : "+r" (c) : "rm" (w));
+    }
+    uint32_t c32 = (uint32_t) c;
+    for ( ; len > 0; p++, len-- ) {
+        __asm__("crc32b %1, %0" : "+r" (c32) : "rm" (*p));
+    }
+    return c32;
+}
+#endif
+
+uint32_t mod_lua_crc32c(uint32_t crc, const void * data, size_t len) {
+    const uint8_t * p = (const uint8_t *) data;
+
+    pthread_once(&hash_once, hash_init);
+
+    crc = ~crc;
+#if defined(__x86_64__)
+    if ( crc32c_sse42 ) {
+        return ~hash_crc32c_sse42(crc, p, len);
+    }
+#endif
+    while ( len-- ) {
+        crc = (crc >> 8) ^ crc32c_table[(crc ^ *p++) & 0xFF];
+    }
+    return ~crc;
+}
+
+/**
+ * MurmurHash64A: a word at a time, then the tail.
+ */
+uint64_t mod_lua_hash64(const void * data, size_t len, uint64_t seed) {
+    const uint8_t * p   = (const uint8_t *) data;
+    const uint8_t * end = p + (len & ~(size_t) 7);
+    uint64_t        h   = seed ^ (len * HASH64_M);
+
+    for ( ; p != end; p += 8 ) {
+        uint64_t k;
+        memcpy(&k, p, 8);
+        k *= HASH64_M;
+        k ^= k >> HASH64_R;
+        k *= HASH64_M;
+        h ^= k;
+        h *= HASH64_M;
+    }
+
+    uint64_t k = 0;
+    switch ( len & 7 ) {
+        case 7: k ^= (uint64_t) p[6] << 48;
+        case 6: k ^= (uint64_t) p[5] << 40;
+        case 5: k ^= (uint64_t) p[4] << 32;
+        case 4: k ^= (uint64_t) p[3] << 24;
+        case 3: k ^= (uint64_t) p[2] << 16;
+        case 2: k ^= (uint64_t) p[1] << 8;
+        case 1: k ^= (uint64_t) p[0];
+                h ^= k;
+                h *= HASH64_M;
+    }
+
+    h ^= h >> HASH64_R;
+    h *= HASH64_M;
+    h ^= h >> HASH64_R;
+    return h;
+}
+
+static bool hash_isclass(lua_State * l, int index, const char * type) {
+    bool match = false;
+    if ( lua_getmetatable(l, index) ) {
+        luaL_getmetatable(l, type);
+        match = lua_rawequal(l, -1, -2);
+        if ( !match ) {
+            lua_pushliteral(l, MOD_LUA_REG_HOST_METATABLE);
+            lua_rawget(l, -2);
+            match = lua_rawequal(l, -1, -3);
+            lua_pop(l, 1);
+        }
+        lua_pop(l, 2);
+    }
+    return match;
+}
+
+/**
+ * The bytes hashed for the value at index: the characters of a string
+ * or String, the contents of a Bytes, or the 8 bytes of a number, as an
+ * integer when it is integral, so a number hashes alike whether it was
+ * computed in Lua or read from a bin.
+ */
+static const void * hash_data(lua_State * l, int index, size_t * len, hash_number * n) {
+    switch ( lua_type(l, index) ) {
+        case LUA_TSTRING: {
+            return lua_tolstring(l, index, len);
+        }
+        case LUA_TNUMBER: {
+            lua_Number d = lua_tonumber(l, index);
+            if ( d >= -9223372036854775808.0 && d < 9223372036854775808.0 && d == (lua_Number) (int64_t) d ) {
+                // -0 is integral, so hashes as 0 does
+                n->i = (int64_t) d;
+            }
+            else {
+                n->d = d;
+            }
+            *len = sizeof(hash_number);
+            return n;
+        }
+        case LUA_TUSERDATA: {
+            if ( hash_isclass(l, index, "Bytes") ) {
+                as_bytes * b = mod_lua_tobytes(l, index);
+                *len = b ? b->size : 0;
+                return b ? b->value : (const uint8_t *) "";
+            }
+            if ( hash_isclass(l, index, "String") ) {
+                as_string * s = mod_lua_tostring(l, index);
+                *len = s ? as_string_len(s) : 0;
+                return s ? as_string_tostring(s) : "";
+            }
+            break;
+        }
+    }
+    luaL_argerror(l, index, "string, number or bytes expected");
+    return NULL;
+}
+
+/**
+ * Pushes h, or h % modulo when the argument at index is a positive
+ * modulo.
+ */
+static int hash_push(lua_State * l, int index, uint64_t h) {
+    lua_Integer modulo = luaL_optinteger(l, index, 0);
+    if ( modulo > 0 ) {
+        h %= (uint64_t) modulo;
+    }
+    lua_pushnumber(l, (lua_Number) h);
+    return 1;
+}
+
+/**
+ * The CRC-32 of CRC32.Hash(), of a string or number:
+ *      hash.crc32(v [, modulo])
+ *
+ * A number is hashed as tostring() formats it, as CRC32.Hash() did.
+ */
+static int mod_lua_hash_crc32(lua_State * l) {
+    size_t len = 0;
+    const char * s = NULL;
+
+    pthread_once(&hash_once, hash_init);
+
+    if ( lua_type(l, 1) == LUA_TNUMBER ) {
+        // tolstring() would convert the argument in place
+        lua_pushvalue(l, 1);
+        s = lua_tolstring(l, -1, &len);
+        lua_replace(l, 1);
+    }
+    else {
+        s = luaL_checklstring(l, 1, &len);
+    }
+    return hash_push(l, 2, hash_crc32((const uint8_t *) s, len));
+}
+
+/**
+ * The CRC32C of a string, number or bytes:
+ *      hash.crc32c(v [, modulo])
+ */
+static int mod_lua_hash_crc32c(lua_State * l) {
+    size_t len = 0;
+    hash_number n;
+    const void * data = hash_data(l, 1, &len, &n);
+    return hash_push(l, 2, mod_lua_crc32c(0, data, len));
+}
+
+/**
+ * The 64-bit hash of a string, number or bytes:
+ *      hash.hash64(v [, modulo])
+ *
+ * A Lua number holds 53 bits exactly, so without a modulo this is the
+ * top 53 bits of the hash. The modulo is taken of all 64.
+ */
+static int mod_lua_hash_hash64(lua_State * l) {
+    size_t len = 0;
+    hash_number n;
+    const void * data = hash_data(l, 1, &len, &n);
+    uint64_t h = mod_lua_hash64(data, len, 0);
+    if ( luaL_optinteger(l, 2, 0) > 0 ) {
+        return hash_push(l, 2, h);
+    }
+    lua_pushnumber(l, (lua_Number) (h >> 11));
+    return 1;
+}
+
+/******************************************************************************
+ * OBJECT TABLE
+ *****************************************************************************/
+
+static const luaL_reg object_table[] = {
+    {"crc32",           mod_lua_hash_crc32},
+    {"crc32c",          mod_lua_hash_crc32c},
+    {"hash64",          mod_lua_hash_hash64},
+    {0, 0}
+};
+
+static const luaL_reg object_metatable[] = {
+    {0, 0}
+};
+
+/******************************************************************************
+ * REGISTER
+ *****************************************************************************/
+
+int mod_lua_hash_register(lua_State * l) {
+    pthread_once(&hash_once, hash_init);
+    mod_lua_reg_object(l, OBJECT_NAME, object_table, object_metatable);
+    return 1;
+}
@@ -20,9 +20,15 @@
  * IN THE SOFTWARE.
  *****************************************************************************/
 
+#include <string.h>
+
+#include <aerospike/as_arraylist.h>
+#include <aerospike/as_integer.h>
 #include <aerospike/as_iterator.h>
 #include <aerospike/as_list.h>
 #include <aerospike/as_list_iterator.h>
+#include <aerospike/as_map.h>
+#include <aerospike/as_string.h>
 #include <aerospike/as_val.h>
 
 #include <aerospike/mod_lua_val.h>
@@ -39,6 +45,23 @@
 #define OBJECT_NAME "list"
 #define CLASS_NAME  "List"
 
+// list_compare() of values that can't be compared
+#define LIST_COMPARE_ERROR 2
+
+/*******************************************************************************
+ * TYPES
+ ******************************************************************************/
+
+/**
+ * A search key: a Lua number, or the characters of a string or String.
+ */
+typedef struct {
+    int             type;
+    lua_Number      n;
+    const char *    s;
+    size_t          len;
+} list_key;
+
 /*******************************************************************************
  * FUNCTIONS
  ******************************************************************************/
@@ -49,7 +72,7 @@ as_list * mod_lua_tolist(lua_State * l, int index) {
 }
 
 as_list * mod_lua_pushlist(lua_State * l, as_list * list) {
-    mod_lua_box * box = mod_lua_pushbox(l, MOD_LUA_SCOPE_LUA, list, CLASS_NAME);
+    mod_lua_box * box = mod_lua_sharebox(l, (as_val *) list, CLASS_NAME);
     return (as_list *) mod_lua_box_value(box);
 }
 
@@ -132,6 +155,311 @@ static int mod_lua_list_take(lua_State * l) {
     return 1;
 }
 
+/**
+ * Appends the values of l2 to l1, in place, and returns l1:
+ *      list.concat(l1, l2)
+ */
+static int mod_lua_list_concat(lua_State * l) {
+    as_list * list = mod_lua_checklist(l, 1);
+    as_list * other = mod_lua_checklist(l, 2);
+
+    if ( list && other ) {
+        // l2 may be l1, so its size is taken once
+        uint32_t size = as_list_size(other);
+        for ( uint32_t i = 0; i < size; i++ ) {
+            as_val * value = as_list_get(other, i);
+            if ( value ) {
+                as_val_reserve(value);
+                as_list_append(list, value);
+            }
+        }
+    }
+
+    lua_settop(l, 1);
+    return 1;
+}
+
+/**
+ * Tests whether the userdata at index is of the class type, so its value
+ * can be read as a box.
+ */
+static bool list_isclass(lua_State * l, int index, const char * type) {
+    bool match = false;
+    if ( lua_getmetatable(l, index) ) {
+        luaL_getmetatable(l, type);
+        match = lua_rawequal(l, -1, -2);
+        if ( !match ) {
+            lua_pushliteral(l, MOD_LUA_REG_HOST_METATABLE);
+            lua_rawget(l, -2);
+            match = lua_rawequal(l, -1, -3);
+            lua_pop(l, 1);
+        }
+        lua_pop(l, 2);
+    }
+    return match;
+}
+
+/**
+ * Reads the key at index, or returns false if it is not a number, a
+ * string or a String.
+ */
+static bool list_tokey(lua_State * l, int index, list_key * key) {
+    key->type = lua_type(l, index);
+    switch ( key->type ) {
+        case LUA_TNUMBER: {
+            key->n = lua_tonumber(l, index);
+            return true;
+        }
+        case LUA_TSTRING: {
+            key->s = lua_tolstring(l, index, &key->len);
+            return true;
+        }
+        case LUA_TUSERDATA: {
+            if ( !list_isclass(l, index, "String") ) {
+                return false;
+            }
+            mod_lua_box * box = (mod_lua_box *) lua_touserdata(l, index);
+            as_val * v = mod_lua_box_value(box);
+            if ( v && as_val_type(v) == AS_STRING ) {
+                key->type = LUA_TSTRING;
+                key->s = as_string_tostring((as_string *) v);
+                key->len = as_string_len((as_string *) v);
+                return true;
+            }
+            return false;
+        }
+        default: {
+            return false;
+        }
+    }
+}
+
+/**
+ * Compares key with v, as Lua's < and == would: -1, 0 or 1, or
+ * LIST_COMPARE_ERROR when v is not a value of the key's type.
+ */
+static int list_compare(const list_key * key, const as_val * v) {
+    double d = 0;
+
+    if ( v == NULL ) {
+        return LIST_COMPARE_ERROR;
+    }
+
+    switch ( as_val_type(v) ) {
+        case AS_INTEGER: {
+            if ( key->type != LUA_TNUMBER ) break;
+            d = (double) as_integer_get((as_integer *) v);
+            return key->n < d ? -1 : key->n > d ? 1 : 0;
+        }
+        case AS_BYTES: {
+            if ( key->type != LUA_TNUMBER || !mod_lua_double_get(v, &d) ) break;
+            return key->n < d ? -1 : key->n > d ? 1 : 0;
+        }
+        case AS_STRING: {
+            if ( key->type != LUA_TSTRING ) break;
+            as_string * s = (as_string *) v;
+            size_t len = as_string_len(s);
+            int c = memcmp(key->s, as_string_tostring(s), key->len < len ? key->len : len);
+            if ( c != 0 ) return c < 0 ? -1 : 1;
+            return key->len < len ? -1 : key->len > len ? 1 : 0;
+        }
+        default: {
+            break;
+        }
+    }
+    return LIST_COMPARE_ERROR;
+}
+
+/**
+ * Binary search of a list sorted by its values, or by a field of its
+ * maps:
+ *      local position, found = list.bsearch(l, key [, keyfield])
+ *
+ * The position is that of the first value not less than key, which is
+ * where key would be inserted, and found is whether that value equals
+ * key. Returns nil when key is not a number or a string, or a value
+ * probed can't be compared with it.
+ */
+static int mod_lua_list_bsearch(lua_State * l) {
+    as_list *       list    = mod_lua_checklist(l, 1);
+    const char *    field   = luaL_optstring(l, 3, NULL);
+    list_key        key;
+    as_string       name;
+
+    if ( !list_tokey(l, 2, &key) ) {
+        lua_pushnil(l);
+        return 1;
+    }
+
+    if ( field ) {
+        as_string_init(&name, (char *) field, false);
+    }
+
+    uint32_t lo = 0;
+    uint32_t hi = list ? as_list_size(list) : 0;
+    bool found = false;
+
+    while ( lo < hi ) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        as_val * v = as_list_get(list, mid);
+        if ( field ) {
+            v = v && as_val_type(v) == AS_MAP ? as_map_get((as_map *) v, (as_val *) &name) : NULL;
+        }
+        int c = list_compare(&key, v);
+        if ( c == LIST_COMPARE_ERROR ) {
+            lua_pushnil(l);
+            return 1;
+        }
+        if ( c > 0 ) {
+            lo = mid + 1;
+        }
+        else {
+            hi = mid;
+            found = c == 0;
+        }
+    }
+
+    // Lua is 1 index, C is 0
+    lua_pushinteger(l, lo + 1);
+    lua_pushboolean(l, found);
+    return 2;
+}
+
+/**
+ * The as_arraylist of a List, whose storage insert, remove and split move
+ * with memmove, or a Lua error for other lists.
+ */
+static as_arraylist * mod_lua_list_arraylist(lua_State * l, as_list * list) {
+    if ( list == NULL || (const void *) list->hooks != (const void *) &as_arraylist_list_hooks ) {
+        luaL_error(l, "list is not an arraylist");
+        return NULL;
+    }
+    return (as_arraylist *) list;
+}
+
+/**
+ * Inserts v before position pos, or appends it when pos is past the end:
+ *      list.insert(l, pos, v)
+ */
+static int mod_lua_list_insert(lua_State * l) {
+    as_arraylist *  list    = mod_lua_list_arraylist(l, mod_lua_checklist(l, 1));
+    lua_Integer     pos     = luaL_checkinteger(l, 2);
+    as_val *        value   = NULL;
+
+    luaL_argcheck(l, pos >= 1, 2, "position out of range");
+
+    value = mod_lua_toval(l, 3);
+    if ( value == NULL ) {
+        return 0;
+    }
+
+    // append grows the storage; the values after pos then move up one
+    uint32_t size = list->size;
+    if ( as_arraylist_append(list, value) != AS_ARRAYLIST_OK ) {
+        as_val_destroy(value);
+        return luaL_error(l, "list.insert: out of memory");
+    }
+    if ( (uint32_t) pos <= size ) {
+        // Lua is 1 index, C is 0
+        uint32_t i = (uint32_t) pos - 1;
+        memmove(&list->elements[i + 1], &list->elements[i], (size - i) * sizeof(as_val *));
+        list->elements[i] = value;
+    }
+    return 0;
+}
+
+/**
+ * Removes the value at position pos and returns it, or nil when pos is
+ * out of range:
+ *      list.remove(l, pos)
+ */
+static int mod_lua_list_remove(lua_State * l) {
+    as_arraylist *  list    = mod_lua_list_arraylist(l, mod_lua_checklist(l, 1));
+    lua_Integer     pos     = luaL_checkinteger(l, 2);
+
+    if ( pos < 1 || pos > list->size ) {
+        lua_pushnil(l);
+        return 1;
+    }
+
+    uint32_t i = (uint32_t) pos - 1;
+    as_val * value = list->elements[i];
+    memmove(&list->elements[i], &list->elements[i + 1], (list->size - i - 1) * sizeof(as_val *));
+    list->size--;
+
+    if ( value ) {
+        mod_lua_pushval(l, value);
+        as_val_destroy(value);
+    }
+    else {
+        lua_pushnil(l);
+    }
+    return 1;
+}
+
+/**
+ * Moves the values from position pos to the end into a new list, which is
+ * returned, leaving those before pos in l:
+ *      list.split(l, pos)
+ */
+static int mod_lua_list_split(lua_State * l) {
+    as_arraylist *  list    = mod_lua_list_arraylist(l, mod_lua_checklist(l, 1));
+    lua_Integer     pos     = luaL_checkinteger(l, 2);
+
+    luaL_argcheck(l, pos >= 1 && pos <= list->size + 1, 2, "position out of range");
+
+    uint32_t i = (uint32_t) pos - 1;
+    uint32_t n = list->size - i;
+    as_arraylist * tail = as_arraylist_new(n ? n : 1, 8);
+
+    // the values change lists, so their references do not change
+    memcpy(tail->elements, &list->elements[i], n * sizeof(as_val *));
+    tail->size = n;
+    list->size = i;
+
+    mod_lua_pushlist(l, (as_list *) tail);
+    return 1;
+}
+
+/**
+ * A new list of the values from position from to position to, which
+ * defaults to the end:
+ *      list.slice(l, from [, to])
+ */
+static int mod_lua_list_slice(lua_State * l) {
+    as_list *       list    = mod_lua_checklist(l, 1);
+    uint32_t        size    = list ? as_list_size(list) : 0;
+    lua_Integer     from    = luaL_checkinteger(l, 2);
+    lua_Integer     to      = luaL_optinteger(l, 3, size);
+
+    if ( from < 1 ) from = 1;
+    if ( to > size ) to = size;
+
+    uint32_t n = to >= from ? (uint32_t) (to - from + 1) : 0;
+    as_arraylist * slice = as_arraylist_new(n ? n : 1, 8);
+
+    for ( uint32_t i = 0; i < n; i++ ) {
+        as_val * value = as_list_get(list, (uint32_t) from - 1 + i);
+        if ( value ) {
+            as_val_reserve(value);
+            as_arraylist_append(slice, value);
+        }
+    }
+
+    mod_lua_pushlist(l, (as_list *) slice);
+    return 1;
+}
+
+/**
+ * Copy the list into a Lua table:
+ *      list.totable(l)
+ */
+static int mod_lua_list_totable(lua_State * l) {
+    as_list * list = mod_lua_checklist(l, 1);
+    mod_lua_pushtable(l, (as_val *) list);
+    return 1;
+}
+
 static int mod_lua_list_size(lua_State * l) {
     as_list * list = mod_lua_checklist(l, 1);
     uint32_t size = 0;
@@ -284,11 +612,18 @@ static int mod_lua_list_iterator(lua_State * l) {
 static const luaL_reg object_table[] = {
     {"append",          mod_lua_list_append},
     {"prepend",         mod_lua_list_prepend},
+    {"concat",          mod_lua_list_concat},
+    {"bsearch",         mod_lua_list_bsearch},
+    {"insert",          mod_lua_list_insert},
+    {"remove",          mod_lua_list_remove},
+    {"slice",           mod_lua_list_slice},
+    {"split",           mod_lua_list_split},
     {"take",            mod_lua_list_take},
     {"drop",            mod_lua_list_drop},
     {"size",            mod_lua_list_size},
     {"iterator",        mod_lua_list_iterator},
     {"tostring",        mod_lua_list_tostring},
+    {"totable",         mod_lua_list_totable},
     {0, 0}
 };
 
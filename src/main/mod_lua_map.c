@@ -49,7 +49,7 @@
 }
 
 as_map * mod_lua_pushmap(lua_State * l, as_map * map) {
-    mod_lua_box * box = mod_lua_pushbox(l, MOD_LUA_SCOPE_LUA, map, CLASS_NAME);
+    mod_lua_box * box = mod_lua_sharebox(l, (as_val *) map, CLASS_NAME);
     return (as_map *) mod_lua_box_value(box);
 }
 
@@ -65,6 +65,67 @@ static int mod_lua_map_gc(lua_State * l) {
 
 
 
+/**
+ * Merges m2 into m1, in place, and returns m1:
+ *      map.merge_into(m1, m2 [, f])
+ *
+ * The value of a key in both maps is f(v1, v2), or v2 when f is not
+ * given or returns nil.
+ */
+static int mod_lua_map_merge_into(lua_State * l) {
+    as_map * map = mod_lua_checkmap(l, 1);
+    as_map * other = mod_lua_checkmap(l, 2);
+    bool merge = lua_type(l, 3) == LUA_TFUNCTION;
+
+    if ( map && other ) {
+        as_map_iterator iter;
+        as_map_iterator_init(&iter, other);
+        while ( as_iterator_has_next((as_iterator *) &iter) ) {
+            as_pair * pair = (as_pair *) as_iterator_next((as_iterator *) &iter);
+            as_val * key = pair->_1;
+            as_val * value = pair->_2;
+            as_val * current = merge ? as_map_get(map, key) : NULL;
+
+            if ( current ) {
+                lua_pushvalue(l, 3);
+                mod_lua_pushval(l, current);
+                mod_lua_pushval(l, value);
+                lua_call(l, 2, 1);
+                as_val * merged = mod_lua_takeval(l, -1);
+                lua_pop(l, 1);
+                if ( merged == current ) {
+                    // merged in place, as list.concat() does
+                    as_val_destroy(merged);
+                    continue;
+                }
+                if ( merged ) {
+                    as_val_reserve(key);
+                    as_map_set(map, key, merged);
+                    continue;
+                }
+            }
+
+            as_val_reserve(key);
+            as_val_reserve(value);
+            as_map_set(map, key, value);
+        }
+        as_iterator_destroy((as_iterator *) &iter);
+    }
+
+    lua_settop(l, 1);
+    return 1;
+}
+
+/**
+ * Copy the map into a Lua table:
+ *      map.totable(m)
+ */
+static int mod_lua_map_totable(lua_State * l) {
+    as_map * map = mod_lua_checkmap(l, 1);
+    mod_lua_pushtable(l, (as_val *) map);
+    return 1;
+}
+
 static int mod_lua_map_size(lua_State * l) {
     as_map *    map     = mod_lua_checkmap(l, 1);
     uint32_t    size    = as_map_size(map);
@@ -278,8 +339,10 @@ static const luaL_reg object_table[] = {
     {"pairs",           mod_lua_map_pairs},
     {"keys",            mod_lua_map_keys},
     {"values",          mod_lua_map_values},
+    {"merge_into",      mod_lua_map_merge_into},
     {"size",            mod_lua_map_size},
     {"tostring",        mod_lua_map_tostring},
+    {"totable",         mod_lua_map_totable},
     {0, 0}
 };
 
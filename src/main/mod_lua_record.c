@@ -26,6 +26,7 @@
 #include <aerospike/mod_lua_record.h>
 #include <aerospike/mod_lua_val.h>
 #include <aerospike/mod_lua_bytes.h>
+#include <aerospike/mod_lua_string.h>
 #include <aerospike/mod_lua_reg.h>
 
 #include "internal.h"
@@ -173,6 +174,26 @@ static int mod_lua_record_index(lua_State * l) {
 }
 
 
+/**
+ * Get a value from the named bin, without copying a string into Lua:
+ *      record.ref(r, name)
+ * A string is returned as a String, so it can be written to another bin
+ * or returned without being copied.
+ */
+static int mod_lua_record_ref(lua_State * l) {
+    as_rec *        rec     = mod_lua_checkrecord(l, 1);
+    const char *    name    = luaL_optstring(l, 2, 0);
+    as_val *        value   = name ? (as_val *) as_rec_get(rec, name) : NULL;
+    if ( value != NULL && as_val_type(value) == AS_STRING ) {
+        as_val_reserve(value);
+        mod_lua_pushstring(l, (as_string *) value);
+    }
+    else {
+        mod_lua_pushval(l, value);
+    }
+    return 1;
+}
+
 /**
  * Set a value in the named bin
  */
@@ -204,6 +225,7 @@ static const luaL_reg object_table[] = {
     {"numbins",    mod_lua_record_numbins},
     {"set_flags",  mod_lua_record_set_flags},
     {"set_type",   mod_lua_record_set_type},
+    {"ref",        mod_lua_record_ref},
     {0, 0}
 };
 
@@ -20,6 +20,8 @@
  * IN THE SOFTWARE.
  *****************************************************************************/
 
+#include <string.h>
+
 #include <aerospike/as_val.h>
 
 #include <aerospike/mod_lua_reg.h>
@@ -74,7 +76,29 @@ int mod_lua_reg_class(lua_State * l, const char * name, const luaL_reg * table,
         lua_pushliteral(l, "__metatable");
         lua_pushvalue(l, tableId);
         lua_rawset(l, metatableId);
+    }
 
+    if ( metatable ) {
+        lua_newtable(l);
+        int hostId = lua_gettop(l);
+
+        lua_pushnil(l);
+        while ( lua_next(l, metatableId) != 0 ) {
+            if ( lua_type(l, -2) == LUA_TSTRING && strcmp(lua_tostring(l, -2), "__gc") == 0 ) {
+                lua_pop(l, 1);
+                continue;
+            }
+            lua_pushvalue(l, -2);
+            lua_insert(l, -2);
+            lua_rawset(l, hostId);
+        }
+
+        lua_pushliteral(l, MOD_LUA_REG_HOST_METATABLE);
+        lua_insert(l, -2);
+        lua_rawset(l, metatableId);
+    }
+
+    if ( table && metatable ) {
         lua_pop(l, 1);
     }
 
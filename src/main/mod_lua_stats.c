@@ -0,0 +1,221 @@
+/******************************************************************************
+ * Copyright 2008-2013 by Aerospike.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy 
+ * of this software and associated documentation files (the "Software"), to 
+ * deal in the Software without restriction, including without limitation the 
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or 
+ * sell copies of the Software, and to permit persons to whom the Software is 
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in 
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING 
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ *****************************************************************************/
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <citrusleaf/cf_atomic.h>
+
+#include <aerospike/mod_lua_alloc.h>
+#include <aerospike/mod_lua_stats.h>
+
+#include "internal.h"
+
+/*******************************************************************************
+ * MACROS
+ ******************************************************************************/
+
+// Counters are sharded by thread, so threads rarely share a cache line.
+#define STATS_SHARDS 8
+
+// Power of 2, open addressed.
+#define STATS_TABLE_MAX 1024
+
+/*******************************************************************************
+ * TYPES
+ ******************************************************************************/
+
+struct stats_shard_s;
+typedef struct stats_shard_s stats_shard;
+
+struct cache_shard_s;
+typedef struct cache_shard_s cache_shard;
+
+struct stats_shard_s {
+    cf_atomic64     calls;
+    cf_atomic64     errors;
+    cf_atomic64     latency[MOD_LUA_STATS_PHASES][MOD_LUA_STATS_BUCKETS];
+} __attribute__ ((aligned (64)));
+
+struct cache_shard_s {
+    cf_atomic64     events[MOD_LUA_STATS_CACHE_EVENTS];
+} __attribute__ ((aligned (64)));
+
+struct mod_lua_stats_s {
+    char            module[MOD_LUA_STATS_NAME_MAX];
+    char            function[MOD_LUA_STATS_NAME_MAX];
+    uint32_t        hash;
+    stats_shard     shards[STATS_SHARDS];
+};
+
+/*******************************************************************************
+ * VARIABLES
+ ******************************************************************************/
+
+/**
+ * Entries are only ever added, under stats_lock, and read without it.
+ */
+static mod_lua_stats * volatile stats_table[STATS_TABLE_MAX];
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static cache_shard cache_shards[STATS_SHARDS];
+
+static __thread int stats_shard_id = -1;
+static cf_atomic32 stats_shard_next = 0;
+
+/*******************************************************************************
+ * STATIC FUNCTIONS
+ ******************************************************************************/
+
+static inline int shard_id() {
+    if ( stats_shard_id < 0 ) {
+        stats_shard_id = (int) (cf_atomic32_incr(&stats_shard_next) % STATS_SHARDS);
+    }
+    return stats_shard_id;
+}
+
+static uint32_t stats_hash(const char * module, const char * function) {
+    uint32_t acc = 2166136261u;
+    for ( const char * c = module; *c; c++ ) {
+        acc ^= (uint8_t) *c;
+        acc *= 16777619u;
+    }
+    acc ^= (uint8_t) '.';
+    acc *= 16777619u;
+    for ( const char * c = function; *c; c++ ) {
+        acc ^= (uint8_t) *c;
+        acc *= 16777619u;
+    }
+    return acc;
+}
+
+static inline bool stats_match(const mod_lua_stats * s, uint32_t hash, const char * module, const char * function) {
+    return s->hash == hash 
+        && strncmp(s->module, module, MOD_LUA_STATS_NAME_MAX) == 0 
+        && strncmp(s->function, function, MOD_LUA_STATS_NAME_MAX) == 0;
+}
+
+/*******************************************************************************
+ * FUNCTIONS
+ ******************************************************************************/
+
+mod_lua_stats * mod_lua_stats_get(const char * module, const char * function) {
+    uint32_t hash = stats_hash(module, function);
+    uint32_t i = hash & (STATS_TABLE_MAX - 1);
+    uint32_t n = 0;
+    mod_lua_stats * s = NULL;
+
+    for ( ; n < STATS_TABLE_MAX && (s = stats_table[i]) != NULL; n++, i = (i + 1) & (STATS_TABLE_MAX - 1) ) {
+        if ( stats_match(s, hash, module, function) ) return s;
+    }
+
+    if ( n == STATS_TABLE_MAX ) return NULL;
+
+    pthread_mutex_lock(&stats_lock);
+
+    // another thread may have added it, or taken the slot
+    for ( ; n < STATS_TABLE_MAX && (s = stats_table[i]) != NULL; n++, i = (i + 1) & (STATS_TABLE_MAX - 1) ) {
+        if ( stats_match(s, hash, module, function) ) break;
+    }
+
+    if ( n < STATS_TABLE_MAX && s == NULL ) {
+        s = (mod_lua_stats *) calloc(1, sizeof(mod_lua_stats));
+        if ( s != NULL ) {
+            strncpy(s->module, module, MOD_LUA_STATS_NAME_MAX - 1);
+            strncpy(s->function, function, MOD_LUA_STATS_NAME_MAX - 1);
+            s->hash = hash;
+            __sync_synchronize();
+            stats_table[i] = s;
+        }
+    }
+    else if ( n == STATS_TABLE_MAX ) {
+        s = NULL;
+    }
+
+    pthread_mutex_unlock(&stats_lock);
+    return s;
+}
+
+void mod_lua_stats_call(mod_lua_stats * stats, bool error) {
+    stats_shard * shard = &stats->shards[shard_id()];
+    cf_atomic64_incr(&shard->calls);
+    if ( error ) {
+        cf_atomic64_incr(&shard->errors);
+    }
+}
+
+void mod_lua_stats_latency(mod_lua_stats * stats, mod_lua_stats_phase phase, uint64_t ns) {
+    uint64_t us = ns / 1000;
+    int bucket = us ? 64 - __builtin_clzll(us) : 0;
+    if ( bucket >= MOD_LUA_STATS_BUCKETS ) {
+        bucket = MOD_LUA_STATS_BUCKETS - 1;
+    }
+    cf_atomic64_incr(&stats->shards[shard_id()].latency[phase][bucket]);
+}
+
+void mod_lua_stats_cache(mod_lua_stats_cache_event event) {
+    cf_atomic64_incr(&cache_shards[shard_id()].events[event]);
+}
+
+uint64_t mod_lua_stats_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + (uint64_t) ts.tv_nsec;
+}
+
+void mod_lua_stats_foreach(mod_lua_stats_foreach_callback callback, void * udata) {
+    mod_lua_function_stats totals;
+
+    for ( int i = 0; i < STATS_TABLE_MAX; i++ ) {
+        mod_lua_stats * s = stats_table[i];
+        if ( s == NULL ) continue;
+
+        memset(&totals, 0, sizeof(mod_lua_function_stats));
+        strncpy(totals.module, s->module, MOD_LUA_STATS_NAME_MAX);
+        strncpy(totals.function, s->function, MOD_LUA_STATS_NAME_MAX);
+
+        for ( int j = 0; j < STATS_SHARDS; j++ ) {
+            stats_shard * shard = &s->shards[j];
+            totals.calls += cf_atomic64_get(shard->calls);
+            totals.errors += cf_atomic64_get(shard->errors);
+            for ( int p = 0; p < MOD_LUA_STATS_PHASES; p++ ) {
+                for ( int b = 0; b < MOD_LUA_STATS_BUCKETS; b++ ) {
+                    totals.latency[p][b] += cf_atomic64_get(shard->latency[p][b]);
+                }
+            }
+        }
+
+        if ( !callback(&totals, udata) ) return;
+    }
+}
+
+void mod_lua_stats_cache_get(mod_lua_cache_stats * stats) {
+    memset(stats, 0, sizeof(mod_lua_cache_stats));
+    for ( int j = 0; j < STATS_SHARDS; j++ ) {
+        for ( int e = 0; e < MOD_LUA_STATS_CACHE_EVENTS; e++ ) {
+            stats->events[e] += cf_atomic64_get(cache_shards[j].events[e]);
+        }
+    }
+    stats->memory = mod_lua_alloc_memory();
+}
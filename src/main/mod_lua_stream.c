@@ -24,9 +24,20 @@
 #include <lauxlib.h>
 #include <lualib.h>
 
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <aerospike/as_arraylist.h>
+#include <aerospike/as_hashmap.h>
+#include <aerospike/as_list.h>
+#include <aerospike/as_map.h>
 #include <aerospike/as_val.h>
 
 #include <aerospike/mod_lua_val.h>
+#include <aerospike/mod_lua_bytes.h>
 #include <aerospike/mod_lua_stream.h>
 #include <aerospike/mod_lua_reg.h>
 
@@ -40,10 +51,832 @@
 #define OBJECT_NAME "stream"
 #define CLASS_NAME "Stream"
 
+// Most values moved by one stream.read_batch() call.
+#define BATCH_SIZE_MAX 4096
+
+// Values an aggregate or reduce takes in at least between estimates of
+// its size. Otherwise it takes in an eighth of the values it holds, so
+// estimating costs a constant per value, and a flush overshoots at most
+// an eighth of flush_bytes.
+#define FLUSH_CHECK_MIN 64
+#define FLUSH_CHECK_SHIFT 3
+
+// Deepest nesting walked to estimate the size of a value.
+#define SIZE_DEPTH_MAX 32
+
+// Most values a topk stage keeps.
+#define TOPK_MAX 65536
+
+// A count_distinct sketch has 2^HLL_PRECISION one byte registers.
+#define HLL_PRECISION 12
+#define HLL_REGISTERS (1 << HLL_PRECISION)
+
+/*******************************************************************************
+ * TYPES
+ ******************************************************************************/
+
+typedef enum {
+    PIPE_FILTER,
+    PIPE_MAP,
+    PIPE_AGGREGATE,
+    PIPE_REDUCE,
+    PIPE_LIMIT,
+    PIPE_TOPK,
+    PIPE_DISTINCT,
+    PIPE_SAMPLE,
+    PIPE_COUNT_DISTINCT,
+    PIPE_COUNT_DISTINCT_MERGE,
+    PIPE_COUNT_DISTINCT_ESTIMATE
+} pipe_op_type;
+
+/**
+ * A stage of a pipeline. The function, initial value and accumulator of
+ * a stage are held in slots of the Lua stack, by their absolute index:
+ *  - aggregate: the function, the initial value and the value
+ *  - reduce: the function and the value
+ *  - topk: the key function, the values kept, as a heap, and their keys
+ *  - distinct: the set of values seen, and of lists and maps seen
+ *  - count_distinct: the sketch registers
+ */
+typedef struct {
+    pipe_op_type    type;
+    int             func;
+    int             init;
+    int             acc;
+    bool            started;
+    bool            flush;      // aggregate and reduce: passes its value on once it reaches flush_bytes
+    uint64_t        values;     // aggregate and reduce: values taken in since the last flush
+    uint64_t        check;      // aggregate and reduce: values at which to next estimate its size
+    uint32_t        n;          // limit and topk: the most values passed or kept
+    uint32_t        count;      // limit: the values passed, topk: the values kept
+    double          rate;       // sample: the fraction of values passed
+    unsigned int    seed;       // sample
+} pipe_op;
+
+typedef struct {
+    lua_State *     l;
+    pipe_op *       ops;
+    int             n;
+    as_stream *     ostream;
+    bool            done;
+} stream_pipe;
+
+static const struct {
+    const char *    name;
+    pipe_op_type    type;
+} pipe_op_names[] = {
+    {"filter",                  PIPE_FILTER},
+    {"map",                     PIPE_MAP},
+    {"aggregate",               PIPE_AGGREGATE},
+    {"reduce",                  PIPE_REDUCE},
+    {"limit",                   PIPE_LIMIT},
+    {"topk",                    PIPE_TOPK},
+    {"distinct",                PIPE_DISTINCT},
+    {"sample",                  PIPE_SAMPLE},
+    {"count_distinct",          PIPE_COUNT_DISTINCT},
+    {"count_distinct_merge",    PIPE_COUNT_DISTINCT_MERGE},
+    {"count_distinct_estimate", PIPE_COUNT_DISTINCT_ESTIMATE},
+    {0, 0}
+};
+
+/*******************************************************************************
+ * VARIABLES
+ ******************************************************************************/
+
+/**
+ * Bytes an aggregate or reduce may hold before passing its value on as a
+ * partial result, 0 for no limit. See mod_lua_stream_flush_bytes().
+ */
+static uint64_t flush_bytes = 0;
+
+/*******************************************************************************
+ * STATIC FUNCTIONS
+ ******************************************************************************/
+
+static void pipe_push(stream_pipe * p, int i);
+static void pipe_end(stream_pipe * p, int i);
+
+static bool pipe_isclass(lua_State * l, int index, const char * type) {
+    bool match = false;
+    if ( lua_getmetatable(l, index) ) {
+        luaL_getmetatable(l, type);
+        match = lua_rawequal(l, -1, -2);
+        lua_pop(l, 2);
+    }
+    return match;
+}
+
+/**
+ * Pushes a copy of the value at index, the way stream_ops.lua clones the
+ * initial value of an aggregate: tables are copied shallow, and lists and
+ * maps with list.clone() and map.clone().
+ */
+static void pipe_clone(lua_State * l, int index) {
+    switch ( lua_type(l, index) ) {
+        case LUA_TTABLE: {
+            lua_newtable(l);
+            lua_pushnil(l);
+            while ( lua_next(l, index) != 0 ) {
+                lua_pushvalue(l, -2);
+                lua_insert(l, -2);
+                lua_rawset(l, -4);
+            }
+            return;
+        }
+        case LUA_TUSERDATA: {
+            const char * object = pipe_isclass(l, index, "Map") ? "map" : pipe_isclass(l, index, "List") ? "list" : NULL;
+            if ( object == NULL ) {
+                lua_pushnil(l);
+                return;
+            }
+            lua_getglobal(l, object);
+            lua_getfield(l, -1, "clone");
+            lua_remove(l, -2);
+            lua_pushvalue(l, index);
+            lua_call(l, 1, 1);
+            return;
+        }
+        default: {
+            lua_pushvalue(l, index);
+            return;
+        }
+    }
+}
+
+/**
+ * The val boxed at index. Bytes are read through mod_lua_tobytes(), so a
+ * view is pointed at its parent's current buffer first.
+ */
+static as_val * pipe_toval(lua_State * l, int index) {
+    if ( pipe_isclass(l, index, "Bytes") ) {
+        return (as_val *) mod_lua_tobytes(l, index);
+    }
+    return (as_val *) mod_lua_box_value(mod_lua_tobox(l, index, NULL));
+}
+
+/**
+ * The string form of a list, map or other boxed value, which is how
+ * distinct and count_distinct compare them. NULL if it has none.
+ */
+static char * pipe_tostring(lua_State * l, int index) {
+    as_val * v = pipe_toval(l, index);
+    return v ? as_val_tostring(v) : NULL;
+}
+
+/**
+ * 64 bit hash of the value at index: FNV-1a over the value's type and
+ * bytes, then a finalizer, so the high bits are as well mixed as the low.
+ */
+static uint64_t pipe_hash(lua_State * l, int index) {
+    int             type    = lua_type(l, index);
+    const void *    data    = NULL;
+    size_t          len     = 0;
+    char *          str     = NULL;
+    lua_Number      n       = 0;
+    int             b       = 0;
+
+    switch ( type ) {
+        case LUA_TNUMBER: {
+            // -0 and 0 are equal, so they must hash alike
+            n = lua_tonumber(l, index) + 0.0;
+            data = &n;
+            len = sizeof(n);
+            break;
+        }
+        case LUA_TBOOLEAN: {
+            b = lua_toboolean(l, index);
+            data = &b;
+            len = sizeof(b);
+            break;
+        }
+        case LUA_TSTRING: {
+            data = lua_tolstring(l, index, &len);
+            break;
+        }
+        case LUA_TUSERDATA: {
+            str = pipe_tostring(l, index);
+            data = str;
+            len = str ? strlen(str) : 0;
+            break;
+        }
+    }
+
+    uint64_t h = 14695981039346656037ULL;
+    h = (h ^ (uint64_t) type) * 1099511628211ULL;
+    for ( size_t i = 0; i < len; i++ ) {
+        h = (h ^ ((const uint8_t *) data)[i]) * 1099511628211ULL;
+    }
+    free(str);
+
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+/**
+ * count_distinct keeps a HyperLogLog sketch of HLL_REGISTERS registers,
+ * each the longest run of leading zeros, plus one, seen in the hashes of
+ * the values it selects. The standard error of the estimate is about
+ * 1.04 / sqrt(HLL_REGISTERS), so 1.6%.
+ */
+static void hll_add(uint8_t * registers, uint64_t h) {
+    uint32_t index = (uint32_t) (h >> (64 - HLL_PRECISION));
+    uint64_t rest = (h << HLL_PRECISION) | (1ULL << (HLL_PRECISION - 1));
+    uint8_t rank = (uint8_t) (__builtin_clzll(rest) + 1);
+    if ( rank > registers[index] ) {
+        registers[index] = rank;
+    }
+}
+
+static void hll_merge(uint8_t * registers, const as_bytes * sketch) {
+    if ( sketch == NULL || as_bytes_size(sketch) != HLL_REGISTERS ) {
+        return;
+    }
+    for ( uint32_t i = 0; i < HLL_REGISTERS; i++ ) {
+        if ( sketch->value[i] > registers[i] ) {
+            registers[i] = sketch->value[i];
+        }
+    }
+}
+
+static double hll_estimate(const uint8_t * registers) {
+    double m = HLL_REGISTERS;
+    double sum = 0;
+    uint32_t zeros = 0;
+    for ( uint32_t i = 0; i < HLL_REGISTERS; i++ ) {
+        sum += ldexp(1.0, -registers[i]);
+        if ( registers[i] == 0 ) {
+            zeros++;
+        }
+    }
+    double estimate = (0.7213 / (1 + 1.079 / m)) * m * m / sum;
+    if ( estimate <= 2.5 * m && zeros > 0 ) {
+        // linear counting is more accurate for small cardinalities
+        estimate = m * log(m / zeros);
+    }
+    return floor(estimate + 0.5);
+}
+
+/**
+ * The values topk keeps are a min heap on their keys, so the root is the
+ * value the next larger one replaces. Values are in a Lua table, from 1,
+ * and keys in an array, from 0.
+ */
+static void topk_swap(lua_State * l, pipe_op * op, double * keys, uint32_t a, uint32_t b) {
+    double key = keys[a];
+    keys[a] = keys[b];
+    keys[b] = key;
+    lua_rawgeti(l, op->init, a + 1);
+    lua_rawgeti(l, op->init, b + 1);
+    lua_rawseti(l, op->init, a + 1);
+    lua_rawseti(l, op->init, b + 1);
+}
+
+static void topk_down(lua_State * l, pipe_op * op, double * keys, uint32_t i, uint32_t size) {
+    while ( true ) {
+        uint32_t min = i;
+        uint32_t left = 2 * i + 1;
+        uint32_t right = left + 1;
+        if ( left < size && keys[left] < keys[min] ) min = left;
+        if ( right < size && keys[right] < keys[min] ) min = right;
+        if ( min == i ) return;
+        topk_swap(l, op, keys, i, min);
+        i = min;
+    }
+}
+
+static void topk_up(lua_State * l, pipe_op * op, double * keys, uint32_t i) {
+    while ( i > 0 && keys[i] < keys[(i - 1) / 2] ) {
+        topk_swap(l, op, keys, i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+}
+
+/**
+ * Offers the value on top of the stack to a topk stage, popping it.
+ */
+static void topk_offer(lua_State * l, pipe_op * op) {
+    double * keys = (double *) lua_touserdata(l, op->acc);
+
+    if ( lua_isnil(l, op->func) ) {
+        if ( lua_type(l, -1) != LUA_TNUMBER ) {
+            luaL_error(l, "topk requires a key function for values that are not numbers");
+        }
+        lua_pushvalue(l, -1);
+    }
+    else {
+        lua_pushvalue(l, op->func);
+        lua_pushvalue(l, -2);
+        lua_call(l, 1, 1);
+        if ( lua_type(l, -1) != LUA_TNUMBER ) {
+            luaL_error(l, "topk key function must return a number");
+        }
+    }
+    double key = lua_tonumber(l, -1);
+    lua_pop(l, 1);
+
+    if ( op->count < op->n ) {
+        keys[op->count] = key;
+        lua_rawseti(l, op->init, op->count + 1);
+        topk_up(l, op, keys, op->count);
+        op->count++;
+    }
+    else if ( op->n > 0 && key > keys[0] ) {
+        keys[0] = key;
+        lua_rawseti(l, op->init, 1);
+        topk_down(l, op, keys, 0, op->count);
+    }
+    else {
+        lua_pop(l, 1);
+    }
+}
+
+/**
+ * Tests whether a distinct stage has seen the value on top of the stack,
+ * and remembers it if not. Values without a string form are never equal.
+ */
+static bool distinct_seen(lua_State * l, pipe_op * op) {
+    int set = op->acc;
+
+    if ( lua_type(l, -1) == LUA_TUSERDATA ) {
+        char * str = pipe_tostring(l, -1);
+        if ( str == NULL ) {
+            return false;
+        }
+        lua_pushstring(l, str);
+        free(str);
+        set = op->init;
+    }
+    else if ( lua_type(l, -1) == LUA_TNUMBER && lua_tonumber(l, -1) != lua_tonumber(l, -1) ) {
+        // NaN can not be a key
+        return false;
+    }
+    else {
+        lua_pushvalue(l, -1);
+    }
+
+    lua_pushvalue(l, -1);
+    lua_rawget(l, set);
+    bool seen = !lua_isnil(l, -1);
+    lua_pop(l, 1);
+
+    if ( seen ) {
+        lua_pop(l, 1);
+    }
+    else {
+        lua_pushboolean(l, true);
+        lua_rawset(l, set);
+    }
+    return seen;
+}
+
+typedef struct {
+    uint64_t    size;
+    int         depth;
+} size_data;
+
+static uint64_t val_size(const as_val * v, int depth);
+
+static bool val_size_list_foreach(as_val * v, void * udata) {
+    size_data * data = (size_data *) udata;
+    data->size += sizeof(as_val *) + val_size(v, data->depth);
+    return true;
+}
+
+static bool val_size_map_foreach(const as_val * k, const as_val * v, void * udata) {
+    size_data * data = (size_data *) udata;
+    data->size += 2 * sizeof(as_val *) + val_size(k, data->depth) + val_size(v, data->depth);
+    return true;
+}
+
+/**
+ * Estimates the bytes held by a val: its own struct, plus its contents.
+ */
+static uint64_t val_size(const as_val * v, int depth) {
+    if ( v == NULL ) {
+        return 0;
+    }
+
+    size_data data = {
+        .size   = 0,
+        .depth  = depth + 1
+    };
+
+    switch ( as_val_type(v) ) {
+        case AS_INTEGER: {
+            return sizeof(as_integer);
+        }
+        case AS_STRING: {
+            return sizeof(as_string) + as_string_len((as_string *) v);
+        }
+        case AS_BYTES: {
+            return sizeof(as_bytes) + as_bytes_size((as_bytes *) v);
+        }
+        case AS_LIST: {
+            data.size = sizeof(as_arraylist);
+            if ( depth < SIZE_DEPTH_MAX ) {
+                as_list_foreach((as_list *) v, val_size_list_foreach, &data);
+            }
+            return data.size;
+        }
+        case AS_MAP: {
+            data.size = sizeof(as_hashmap);
+            if ( depth < SIZE_DEPTH_MAX ) {
+                as_map_foreach((as_map *) v, val_size_map_foreach, &data);
+            }
+            return data.size;
+        }
+        default: {
+            return sizeof(as_val);
+        }
+    }
+}
+
+/**
+ * Estimates the bytes held by the Lua value at index.
+ */
+static uint64_t pipe_size(lua_State * l, int index, int depth) {
+    switch ( lua_type(l, index) ) {
+        case LUA_TSTRING: {
+            return lua_objlen(l, index);
+        }
+        case LUA_TTABLE: {
+            uint64_t size = 0;
+            if ( depth >= SIZE_DEPTH_MAX ) {
+                return size;
+            }
+            int t = index > 0 ? index : lua_gettop(l) + index + 1;
+            lua_pushnil(l);
+            while ( lua_next(l, t) != 0 ) {
+                size += 2 * sizeof(lua_Number) + pipe_size(l, -2, depth + 1) + pipe_size(l, -1, depth + 1);
+                lua_pop(l, 1);
+            }
+            return size;
+        }
+        case LUA_TUSERDATA: {
+            if ( pipe_isclass(l, index, "Map") || pipe_isclass(l, index, "List") || pipe_isclass(l, index, "Bytes") ) {
+                return val_size(pipe_toval(l, index), depth);
+            }
+            return 0;
+        }
+        default: {
+            return sizeof(lua_Number);
+        }
+    }
+}
+
+/**
+ * Counts a value taken in by an aggregate or reduce, and tests whether
+ * the stage should pass its value on: when it is flushable and, at one of
+ * the checks spaced out by FLUSH_CHECK_MIN and FLUSH_CHECK_SHIFT, its
+ * size is estimated to have reached flush_bytes.
+ */
+static bool pipe_full(lua_State * l, pipe_op * op) {
+    op->values++;
+    if ( !op->flush || op->values < op->check ) {
+        return false;
+    }
+    uint64_t next = op->values >> FLUSH_CHECK_SHIFT;
+    op->check = op->values + (next > FLUSH_CHECK_MIN ? next : FLUSH_CHECK_MIN);
+    return pipe_size(l, op->acc, 0) >= flush_bytes;
+}
+
+static void pipe_restart(pipe_op * op) {
+    op->started = false;
+    op->values = 0;
+    op->check = FLUSH_CHECK_MIN;
+}
+
+/**
+ * Pushes the value on top of the stack through the stages from i on,
+ * popping it. A nil value ends the stream for the stages it reaches.
+ */
+static void pipe_push(stream_pipe * p, int i) {
+    lua_State * l = p->l;
+
+    for ( ; i < p->n; i++ ) {
+        pipe_op * op = &p->ops[i];
+
+        if ( lua_isnil(l, -1) ) {
+            lua_pop(l, 1);
+            pipe_end(p, i);
+            return;
+        }
+
+        switch ( op->type ) {
+            case PIPE_FILTER: {
+                lua_pushvalue(l, op->func);
+                lua_pushvalue(l, -2);
+                lua_call(l, 1, 1);
+                int pass = lua_toboolean(l, -1);
+                lua_pop(l, 1);
+                if ( !pass ) {
+                    lua_pop(l, 1);
+                    return;
+                }
+                break;
+            }
+            case PIPE_MAP: {
+                lua_pushvalue(l, op->func);
+                lua_insert(l, -2);
+                lua_call(l, 1, 1);
+                break;
+            }
+            case PIPE_AGGREGATE: {
+                if ( !op->started ) {
+                    pipe_clone(l, op->init);
+                    lua_replace(l, op->acc);
+                    op->started = true;
+                }
+                lua_pushvalue(l, op->func);
+                lua_pushvalue(l, op->acc);
+                lua_pushvalue(l, -3);
+                lua_call(l, 2, 1);
+                lua_replace(l, op->acc);
+                lua_pop(l, 1);
+                if ( !pipe_full(l, op) ) {
+                    return;
+                }
+                lua_pushvalue(l, op->acc);
+                pipe_restart(op);
+                break;
+            }
+            case PIPE_REDUCE: {
+                if ( !op->started ) {
+                    lua_replace(l, op->acc);
+                    op->started = true;
+                }
+                else {
+                    lua_pushvalue(l, op->func);
+                    lua_pushvalue(l, op->acc);
+                    lua_pushvalue(l, -3);
+                    lua_call(l, 2, 1);
+                    lua_replace(l, op->acc);
+                    lua_pop(l, 1);
+                }
+                if ( !pipe_full(l, op) ) {
+                    return;
+                }
+                lua_pushvalue(l, op->acc);
+                pipe_restart(op);
+                break;
+            }
+            case PIPE_LIMIT: {
+                // the stream ends with the n-th value, so no more are read
+                if ( op->count >= op->n ) {
+                    lua_pop(l, 1);
+                    pipe_end(p, i + 1);
+                    return;
+                }
+                if ( ++op->count == op->n ) {
+                    pipe_push(p, i + 1);
+                    pipe_end(p, i + 1);
+                    return;
+                }
+                break;
+            }
+            case PIPE_TOPK: {
+                topk_offer(l, op);
+                return;
+            }
+            case PIPE_DISTINCT: {
+                if ( distinct_seen(l, op) ) {
+                    lua_pop(l, 1);
+                    return;
+                }
+                break;
+            }
+            case PIPE_SAMPLE: {
+                if ( (double) rand_r(&op->seed) / ((double) RAND_MAX + 1) >= op->rate ) {
+                    lua_pop(l, 1);
+                    return;
+                }
+                break;
+            }
+            case PIPE_COUNT_DISTINCT: {
+                hll_add((uint8_t *) lua_touserdata(l, op->acc), pipe_hash(l, -1));
+                lua_pop(l, 1);
+                return;
+            }
+            case PIPE_COUNT_DISTINCT_MERGE:
+            case PIPE_COUNT_DISTINCT_ESTIMATE: {
+                if ( pipe_isclass(l, -1, "Bytes") ) {
+                    hll_merge((uint8_t *) lua_touserdata(l, op->acc), mod_lua_tobytes(l, -1));
+                }
+                lua_pop(l, 1);
+                return;
+            }
+        }
+    }
+
+    if ( lua_isnil(l, -1) ) {
+        lua_pop(l, 1);
+        p->done = true;
+        return;
+    }
+
+    as_stream_write(p->ostream, mod_lua_toval(l, -1));
+    lua_pop(l, 1);
+}
+
+/**
+ * Pushes what stage i holds through the stages after it, at the end of
+ * the stream. Returns false if the stage holds nothing.
+ */
+static bool pipe_flush(stream_pipe * p, int i) {
+    lua_State * l = p->l;
+    pipe_op * op = &p->ops[i];
+
+    switch ( op->type ) {
+        case PIPE_AGGREGATE: {
+            if ( op->started ) {
+                lua_pushvalue(l, op->acc);
+            }
+            else {
+                pipe_clone(l, op->init);
+            }
+            pipe_restart(op);
+            pipe_push(p, i + 1);
+            return true;
+        }
+        case PIPE_REDUCE: {
+            if ( op->started ) {
+                lua_pushvalue(l, op->acc);
+            }
+            else {
+                lua_pushnil(l);
+            }
+            pipe_restart(op);
+            pipe_push(p, i + 1);
+            return true;
+        }
+        case PIPE_TOPK: {
+            // sort the heap in place, which leaves the largest key first
+            double * keys = (double *) lua_touserdata(l, op->acc);
+            for ( uint32_t size = op->count; size > 1; size-- ) {
+                topk_swap(l, op, keys, 0, size - 1);
+                topk_down(l, op, keys, 0, size - 1);
+            }
+            for ( uint32_t k = 1; k <= op->count && !p->done; k++ ) {
+                lua_rawgeti(l, op->init, k);
+                pipe_push(p, i + 1);
+            }
+            op->count = 0;
+            return true;
+        }
+        case PIPE_COUNT_DISTINCT:
+        case PIPE_COUNT_DISTINCT_MERGE: {
+            as_bytes * sketch = as_bytes_new(HLL_REGISTERS);
+            as_bytes_append(sketch, (uint8_t *) lua_touserdata(l, op->acc), HLL_REGISTERS);
+            mod_lua_pushbytes(l, sketch);
+            pipe_push(p, i + 1);
+            return true;
+        }
+        case PIPE_COUNT_DISTINCT_ESTIMATE: {
+            lua_pushnumber(l, hll_estimate((uint8_t *) lua_touserdata(l, op->acc)));
+            pipe_push(p, i + 1);
+            return true;
+        }
+        default: {
+            return false;
+        }
+    }
+}
+
+/**
+ * Ends the stream for the stages from i on: the first of them that holds
+ * values pushes them on, then the stream ends for the stages after it.
+ */
+static void pipe_end(stream_pipe * p, int i) {
+    for ( ; i < p->n && !p->done; i++ ) {
+        if ( pipe_flush(p, i) ) {
+            pipe_end(p, i + 1);
+            return;
+        }
+    }
+
+    p->done = true;
+}
+
+/**
+ * Reads the stage at the top of the stack, an op built by StreamOps, and
+ * replaces it with its function, initial value and accumulator slots.
+ */
+static void pipe_op_init(lua_State * l, pipe_op * op) {
+    int index = lua_gettop(l);
+
+    memset(op, 0, sizeof(pipe_op));
+
+    lua_getfield(l, index, "name");
+    const char * name = lua_tostring(l, -1);
+    if ( name == NULL ) {
+        luaL_error(l, "stream operation has no name");
+    }
+
+    int t = 0;
+    while ( pipe_op_names[t].name && strcmp(pipe_op_names[t].name, name) != 0 ) {
+        t++;
+    }
+    if ( pipe_op_names[t].name == NULL ) {
+        luaL_error(l, "unsupported stream operation: %s", name);
+    }
+    op->type = pipe_op_names[t].type;
+
+    lua_getfield(l, index, "args");
+    luaL_checktype(l, -1, LUA_TTABLE);
+    int args = lua_gettop(l);
+
+    switch ( op->type ) {
+        case PIPE_FILTER:
+        case PIPE_MAP:
+        case PIPE_REDUCE: {
+            lua_rawgeti(l, args, 1);
+            lua_pushnil(l);
+            lua_pushnil(l);
+            if ( lua_type(l, -3) != LUA_TFUNCTION ) {
+                luaL_error(l, "stream operation %s requires a function", name);
+            }
+            break;
+        }
+        case PIPE_AGGREGATE: {
+            lua_rawgeti(l, args, 2);
+            lua_rawgeti(l, args, 1);
+            lua_pushnil(l);
+            if ( lua_type(l, -3) != LUA_TFUNCTION ) {
+                luaL_error(l, "stream operation %s requires a function", name);
+            }
+            break;
+        }
+        case PIPE_LIMIT:
+        case PIPE_TOPK: {
+            lua_rawgeti(l, args, 1);
+            lua_Number n = lua_tonumber(l, -1);
+            lua_pop(l, 1);
+            if ( !(n >= 0) || (op->type == PIPE_TOPK && n > TOPK_MAX) ) {
+                luaL_error(l, "stream operation %s requires a count from 0 to %d", name, op->type == PIPE_TOPK ? TOPK_MAX : INT32_MAX);
+            }
+            op->n = n < INT32_MAX ? (uint32_t) n : INT32_MAX;
+            if ( op->type == PIPE_LIMIT ) {
+                lua_pushnil(l);
+                lua_pushnil(l);
+                lua_pushnil(l);
+                break;
+            }
+            lua_rawgeti(l, args, 2);
+            if ( !lua_isnil(l, -1) && lua_type(l, -1) != LUA_TFUNCTION ) {
+                luaL_error(l, "stream operation %s requires a key function", name);
+            }
+            lua_createtable(l, (int) op->n, 0);
+            lua_newuserdata(l, sizeof(double) * (op->n > 0 ? op->n : 1));
+            break;
+        }
+        case PIPE_DISTINCT: {
+            lua_pushnil(l);
+            lua_newtable(l);
+            lua_newtable(l);
+            break;
+        }
+        case PIPE_SAMPLE: {
+            lua_rawgeti(l, args, 1);
+            op->rate = lua_tonumber(l, -1);
+            op->seed = (unsigned int) time(NULL) ^ (unsigned int) (uintptr_t) op;
+            lua_pop(l, 1);
+            lua_pushnil(l);
+            lua_pushnil(l);
+            lua_pushnil(l);
+            break;
+        }
+        case PIPE_COUNT_DISTINCT:
+        case PIPE_COUNT_DISTINCT_MERGE:
+        case PIPE_COUNT_DISTINCT_ESTIMATE: {
+            lua_pushnil(l);
+            lua_pushnil(l);
+            memset(lua_newuserdata(l, HLL_REGISTERS), 0, HLL_REGISTERS);
+            break;
+        }
+    }
+
+    lua_remove(l, args);
+    lua_remove(l, index + 1);
+    lua_remove(l, index);
+
+    op->check = FLUSH_CHECK_MIN;
+    op->func = lua_gettop(l) - 2;
+    op->init = lua_gettop(l) - 1;
+    op->acc = lua_gettop(l);
+}
+
 /*******************************************************************************
  * FUNCTIONS
  ******************************************************************************/
 
+void mod_lua_stream_flush_bytes(uint64_t bytes) {
+    flush_bytes = bytes;
+}
+
 as_stream * mod_lua_tostream(lua_State * l, int index) {
     mod_lua_box * box = mod_lua_tobox(l, index, CLASS_NAME);
     return (as_stream *) mod_lua_box_value(box);
@@ -112,6 +945,100 @@ static int mod_lua_stream_write(lua_State * l) {
     }
 }
 
+/**
+ * Reads up to n values from the stream into a table, stopping early at the
+ * end of the stream. Returns the table and the number of values read:
+ *      local values, count = stream.read_batch(s, n [, values])
+ *
+ * The table given as the third argument is refilled, rather than a new one
+ * created, and cleared past the values read.
+ */
+static int mod_lua_stream_read_batch(lua_State * l) {
+    as_stream * stream = mod_lua_tostream(l, 1);
+    lua_Integer n = luaL_optinteger(l, 2, 1);
+    int count = 0;
+
+    if ( n > BATCH_SIZE_MAX ) {
+        n = BATCH_SIZE_MAX;
+    }
+
+    if ( lua_type(l, 3) == LUA_TTABLE ) {
+        lua_settop(l, 3);
+    }
+    else {
+        lua_settop(l, 2);
+        lua_createtable(l, n > 0 ? (int) n : 0, 0);
+    }
+
+    while ( stream && count < n ) {
+        as_val * val = as_stream_read(stream);
+        if ( val == AS_STREAM_END ) {
+            break;
+        }
+        mod_lua_pushval(l, val);
+        if ( lua_isnil(l, -1) ) {
+            lua_pop(l, 1);
+            break;
+        }
+        lua_rawseti(l, 3, ++count);
+    }
+
+    // clear what is left of a refilled table
+    for ( int i = count + 1; ; i++ ) {
+        lua_rawgeti(l, 3, i);
+        bool last = lua_isnil(l, -1);
+        lua_pop(l, 1);
+        if ( last ) break;
+        lua_pushnil(l);
+        lua_rawseti(l, 3, i);
+    }
+
+    lua_pushinteger(l, count);
+    return 2;
+}
+
+/**
+ * Writes each value of a table, from 1 to the first nil, or of a list, to
+ * the stream. Returns the status of the first write that failed, or of
+ * the last write:
+ *      stream.write_batch(s, values)
+ */
+static int mod_lua_stream_write_batch(lua_State * l) {
+    as_stream * stream = mod_lua_tostream(l, 1);
+    int rc = AS_STREAM_OK;
+
+    if ( stream == NULL ) {
+        lua_pushinteger(l, AS_STREAM_ERR);
+        return 1;
+    }
+
+    if ( lua_type(l, 2) == LUA_TTABLE ) {
+        for ( int i = 1; rc == AS_STREAM_OK; i++ ) {
+            lua_rawgeti(l, 2, i);
+            if ( lua_isnil(l, -1) ) {
+                lua_pop(l, 1);
+                break;
+            }
+            rc = as_stream_write(stream, mod_lua_toval(l, -1));
+            lua_pop(l, 1);
+        }
+    }
+    else {
+        as_list * list = (as_list *) mod_lua_box_value(mod_lua_checkbox(l, 2, "List"));
+        uint32_t size = list ? as_list_size(list) : 0;
+        for ( uint32_t i = 0; i < size && rc == AS_STREAM_OK; i++ ) {
+            as_val * val = as_list_get(list, i);
+            if ( val ) {
+                as_val_reserve(val);
+            }
+            rc = as_stream_write(stream, val);
+        }
+    }
+
+    lua_pushinteger(l, rc);
+    return 1;
+}
+
 static int mod_lua_stream_writable(lua_State * l) {
     as_stream * stream = mod_lua_tostream(l, 1);
     if ( stream ) {
@@ -124,6 +1051,92 @@ static int mod_lua_stream_writable(lua_State * l) {
     }
 }
 
+/**
+ * Decides which aggregates and reduces may pass their value on early, once
+ * it reaches flush_bytes, leaving a later reduce to combine the partial
+ * values: an aggregate followed by a reduce, with only filters and maps
+ * between them, and the last stage, when it is a reduce and the output is
+ * itself reduced again by the receiver.
+ */
+static void pipe_flush_init(stream_pipe * p, bool partial) {
+    bool reduced = partial;
+    for ( int i = p->n - 1; i >= 0; i-- ) {
+        pipe_op * op = &p->ops[i];
+        switch ( op->type ) {
+            case PIPE_REDUCE: {
+                op->flush = flush_bytes > 0 && reduced && i == p->n - 1;
+                reduced = true;
+                break;
+            }
+            case PIPE_AGGREGATE: {
+                op->flush = flush_bytes > 0 && reduced && i < p->n - 1;
+                reduced = false;
+                break;
+            }
+            case PIPE_FILTER:
+            case PIPE_MAP: {
+                break;
+            }
+            default: {
+                reduced = false;
+                break;
+            }
+        }
+    }
+}
+
+/**
+ * Applies a sequence of stream operations, reading values from istream and
+ * writing the results, then nil, to ostream:
+ *      stream.pipe(istream, ops, ostream [, partial])
+ *
+ * Values are pushed through every stage in a single loop, so only the
+ * functions given to the stages run in Lua. When partial is true, the
+ * receiver of ostream reduces the results again, so a final reduce may
+ * write partial results, as aggregates followed by a reduce may pass them
+ * on, rather than hold more than flush_bytes.
+ */
+static int mod_lua_stream_pipe(lua_State * l) {
+    as_stream * istream = mod_lua_tostream(l, 1);
+    as_stream * ostream = mod_lua_tostream(l, 3);
+    luaL_checktype(l, 2, LUA_TTABLE);
+    if ( ostream == NULL ) {
+        return luaL_argerror(l, 3, "stream expected");
+    }
+
+    int n = (int) lua_objlen(l, 2);
+    luaL_checkstack(l, n * 3 + LUA_MINSTACK, "too many stream operations");
+
+    stream_pipe p = {
+        .l          = l,
+        .ops        = (pipe_op *) lua_newuserdata(l, sizeof(pipe_op) * (n > 0 ? n : 1)),
+        .n          = n,
+        .ostream    = ostream,
+        .done       = false
+    };
+
+    for ( int i = 0; i < n; i++ ) {
+        lua_rawgeti(l, 2, i + 1);
+        luaL_checktype(l, -1, LUA_TTABLE);
+        pipe_op_init(l, &p.ops[i]);
+    }
+
+    pipe_flush_init(&p, lua_toboolean(l, 4));
+
+    while ( !p.done ) {
+        as_val * v = istream ? as_stream_read(istream) : AS_STREAM_END;
+        if ( v == AS_STREAM_END ) {
+            pipe_end(&p, 0);
+            break;
+        }
+        mod_lua_pushval(l, v);
+        pipe_push(&p, 0);
+    }
+
+    as_stream_write(ostream, AS_STREAM_END);
+    return 0;
+}
+
 /*******************************************************************************
  * OBJECT TABLE
  ******************************************************************************/
@@ -133,6 +1146,9 @@ static const luaL_reg object_table[] = {
     {"write",           mod_lua_stream_write},
     {"readable",        mod_lua_stream_readable},
     {"writable",        mod_lua_stream_writable},
+    {"read_batch",      mod_lua_stream_read_batch},
+    {"write_batch",     mod_lua_stream_write_batch},
+    {"pipe",            mod_lua_stream_pipe},
     {"tostring",        mod_lua_stream_tostring},
     {0, 0}
 };
@@ -0,0 +1,149 @@
+/******************************************************************************
+ * Copyright 2008-2013 by Aerospike.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy 
+ * of this software and associated documentation files (the "Software"), to 
+ * deal in the Software without restriction, including without limitation the 
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or 
+ * sell copies of the Software, and to permit persons to whom the Software is 
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in 
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING 
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ *****************************************************************************/
+
+#include <string.h>
+
+#include <aerospike/as_string.h>
+#include <aerospike/as_val.h>
+
+#include <aerospike/mod_lua_val.h>
+#include <aerospike/mod_lua_string.h>
+#include <aerospike/mod_lua_reg.h>
+
+#include "internal.h"
+
+/*******************************************************************************
+ * MACROS
+ ******************************************************************************/
+
+#define CLASS_NAME  "String"
+
+/*******************************************************************************
+ * FUNCTIONS
+ ******************************************************************************/
+
+/**
+ * A String is an as_string held by Lua without copying it into the Lua
+ * heap. It is only copied when converted with tostring(). Assigning it
+ * to a bin, or returning it, passes the as_string itself.
+ *
+ * Lua 5.1 only calls __eq when both operands are userdata, so == is
+ * always false between a String and a Lua string. Compare them with
+ * String.eq(s, v), s:eq(v), or tostring(s) == v.
+ */
+as_string * mod_lua_tostring(lua_State * l, int index) {
+    mod_lua_box * box = mod_lua_tobox(l, index, CLASS_NAME);
+    return (as_string *) mod_lua_box_value(box);
+}
+
+as_string * mod_lua_pushstring(lua_State * l, as_string * s) {
+    mod_lua_box * box = mod_lua_pushbox(l, MOD_LUA_SCOPE_LUA, s, CLASS_NAME);
+    return (as_string *) mod_lua_box_value(box);
+}
+
+static as_string * mod_lua_checkstring(lua_State * l, int index) {
+    mod_lua_box * box = mod_lua_checkbox(l, index, CLASS_NAME);
+    return (as_string *) mod_lua_box_value(box);
+}
+
+/**
+ * The characters of a String or a Lua string (or number) at index.
+ */
+static const char * mod_lua_string_chars(lua_State * l, int index, size_t * len) {
+    if ( lua_type(l, index) == LUA_TUSERDATA ) {
+        as_string * s = mod_lua_checkstring(l, index);
+        *len = s ? as_string_len(s) : 0;
+        return s ? as_string_tostring(s) : "";
+    }
+    return luaL_checklstring(l, index, len);
+}
+
+static int mod_lua_string_gc(lua_State * l) {
+    mod_lua_freebox(l, 1, CLASS_NAME);
+    return 0;
+}
+
+static int mod_lua_string_tostring(lua_State * l) {
+    size_t len = 0;
+    const char * c = mod_lua_string_chars(l, 1, &len);
+    lua_pushlstring(l, c, len);
+    return 1;
+}
+
+static int mod_lua_string_len(lua_State * l) {
+    as_string * s = mod_lua_checkstring(l, 1);
+    lua_pushinteger(l, s ? as_string_len(s) : 0);
+    return 1;
+}
+
+static int mod_lua_string_concat(lua_State * l) {
+    size_t alen = 0, blen = 0;
+    const char * a = mod_lua_string_chars(l, 1, &alen);
+    const char * b = mod_lua_string_chars(l, 2, &blen);
+
+    luaL_Buffer buf;
+    luaL_buffinit(l, &buf);
+    luaL_addlstring(&buf, a, alen);
+    luaL_addlstring(&buf, b, blen);
+    luaL_pushresult(&buf);
+    return 1;
+}
+
+/**
+ * Whether a String has the same characters as another String, or a Lua
+ * string, without copying either:
+ *      String.eq(s, v)
+ */
+static int mod_lua_string_eq(lua_State * l) {
+    size_t alen = 0, blen = 0;
+    const char * a = mod_lua_string_chars(l, 1, &alen);
+    const char * b = mod_lua_string_chars(l, 2, &blen);
+    lua_pushboolean(l, alen == blen && memcmp(a, b, alen) == 0);
+    return 1;
+}
+
+/******************************************************************************
+ * CLASS TABLE
+ *****************************************************************************/
+
+static const luaL_reg class_table[] = {
+    {"eq",              mod_lua_string_eq},
+    {0, 0}
+};
+
+static const luaL_reg class_metatable[] = {
+    {"__gc",            mod_lua_string_gc},
+    {"__tostring",      mod_lua_string_tostring},
+    {"__len",           mod_lua_string_len},
+    {"__concat",        mod_lua_string_concat},
+    {"__eq",            mod_lua_string_eq},
+    {0, 0}
+};
+
+/*******************************************************************************
+ * ~~~ Register ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+ ******************************************************************************/
+
+int mod_lua_string_register(lua_State * l) {
+    mod_lua_reg_class(l, CLASS_NAME, class_table, class_metatable);
+    return 1;
+}
@@ -20,6 +20,8 @@
  * IN THE SOFTWARE.
  *****************************************************************************/
 
+#include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 
@@ -27,6 +29,10 @@
 #include <lauxlib.h>
 #include <lualib.h>
 
+#include <aerospike/as_arraylist.h>
+#include <aerospike/as_hashmap.h>
+#include <aerospike/as_list.h>
+#include <aerospike/as_map.h>
 #include <aerospike/as_val.h>
 
 #include <aerospike/mod_lua_val.h>
@@ -34,9 +40,204 @@
 #include <aerospike/mod_lua_map.h>
 #include <aerospike/mod_lua_record.h>
 #include <aerospike/mod_lua_bytes.h>
+#include <aerospike/mod_lua_reg.h>
 
 #include "internal.h"
 
+/*******************************************************************************
+ * MACROS
+ ******************************************************************************/
+
+// Deepest nesting converted between Lua tables and lists or maps.
+#define TABLE_DEPTH_MAX 32
+
+// Most entries in a Lua table converted to a list or map.
+#define TABLE_SIZE_MAX (1 << 20)
+
+/*******************************************************************************
+ * TYPES
+ ******************************************************************************/
+
+typedef struct {
+    lua_State * l;
+    int         depth;
+    int         index;
+} pushtable_data;
+
+/*******************************************************************************
+ * VARIABLES
+ ******************************************************************************/
+
+/**
+ * Registry key for a state's shared boxes: a weak valued table of the
+ * boxes pushed by mod_lua_sharebox(), keyed by their value.
+ */
+static char sharebox_key;
+
+/*******************************************************************************
+ * STATIC FUNCTIONS
+ ******************************************************************************/
+
+static as_val * toval(lua_State * l, int i, int depth);
+static int pushtable(lua_State * l, const as_val * v, int depth);
+
+/**
+ * Converts the table at index i to a list, if its keys are exactly 1..n,
+ * otherwise to a map. Tables nested too deep, or too large, are NULL.
+ * So is a list with an element that does not convert, as dropping it
+ * would move every later element. A map only drops that pair.
+ */
+static as_val * table_toval(lua_State * l, int i, int depth) {
+    if ( depth >= TABLE_DEPTH_MAX || !lua_checkstack(l, 3) ) {
+        return NULL;
+    }
+
+    if ( i < 0 && i > LUA_REGISTRYINDEX ) {
+        i = lua_gettop(l) + i + 1;
+    }
+
+    size_t n = lua_objlen(l, i);
+    size_t count = 0;
+    bool sequence = true;
+
+    lua_pushnil(l);
+    while ( lua_next(l, i) != 0 ) {
+        if ( sequence ) {
+            lua_Number k = lua_type(l, -2) == LUA_TNUMBER ? lua_tonumber(l, -2) : 0;
+            sequence = k >= 1 && k <= n && k == (lua_Number) (size_t) k;
+        }
+        count++;
+        lua_pop(l, 1);
+    }
+
+    if ( count > TABLE_SIZE_MAX ) {
+        return NULL;
+    }
+
+    if ( sequence && count == n ) {
+        as_arraylist * list = as_arraylist_new((uint32_t) (n ? n : 1), 8);
+        for ( size_t k = 1; k <= n; k++ ) {
+            lua_rawgeti(l, i, (int) k);
+            as_val * v = toval(l, -1, depth + 1);
+            lua_pop(l, 1);
+            if ( v == NULL ) {
+                as_val_destroy((as_val *) list);
+                return NULL;
+            }
+            as_arraylist_append(list, v);
+        }
+        return (as_val *) list;
+    }
+
+    as_hashmap * map = as_hashmap_new((uint32_t) (count > 32 ? count : 32));
+    lua_pushnil(l);
+    while ( lua_next(l, i) != 0 ) {
+        as_val * k = toval(l, -2, depth + 1);
+        as_val * v = toval(l, -1, depth + 1);
+        if ( !k || !v ) {
+            as_val_destroy(k);
+            as_val_destroy(v);
+        }
+        else {
+            as_map_set((as_map *) map, k, v);
+        }
+        lua_pop(l, 1);
+    }
+    return (as_val *) map;
+}
+
+static bool pushtable_list_foreach(as_val * v, void * udata) {
+    pushtable_data * data = (pushtable_data *) udata;
+    pushtable(data->l, v, data->depth);
+    lua_rawseti(data->l, -2, ++data->index);
+    return true;
+}
+
+static bool pushtable_map_foreach(const as_val * k, const as_val * v, void * udata) {
+    pushtable_data * data = (pushtable_data *) udata;
+    pushtable(data->l, k, data->depth);
+    if ( lua_isnil(data->l, -1) ) {
+        lua_pop(data->l, 1);
+        return true;
+    }
+    pushtable(data->l, v, data->depth);
+    lua_rawset(data->l, -3);
+    return true;
+}
+
+/**
+ * Pushes lists and maps as tables, nested up to TABLE_DEPTH_MAX deep,
+ * and anything else as mod_lua_pushval() does.
+ */
+static int pushtable(lua_State * l, const as_val * v, int depth) {
+    if ( v == NULL || depth >= TABLE_DEPTH_MAX || !lua_checkstack(l, 3) ) {
+        return mod_lua_pushval(l, v);
+    }
+
+    pushtable_data data = {
+        .l = l,
+        .depth = depth + 1,
+        .index = 0
+    };
+
+    switch( as_val_type(v) ) {
+        case AS_LIST: {
+            as_list * list = (as_list *) v;
+            lua_createtable(l, (int) as_list_size(list), 0);
+            as_list_foreach(list, pushtable_list_foreach, &data);
+            return 1;
+        }
+        case AS_MAP: {
+            as_map * map = (as_map *) v;
+            lua_createtable(l, 0, (int) as_map_size(map));
+            as_map_foreach(map, pushtable_map_foreach, &data);
+            return 1;
+        }
+        default: {
+            return mod_lua_pushval(l, v);
+        }
+    }
+}
+
+/*******************************************************************************
+ * FUNCTIONS
+ ******************************************************************************/
+
+/**
+ * Creates a double: 8 bytes, typed AS_BYTES_DOUBLE, holding the bits of d.
+ * Lua numbers that are not integral are converted to these, so they make
+ * the round trip through the host without being truncated.
+ *
+ * @param d the value
+ * @returns the val, with a refcount that must be freed later
+ */
+as_val * mod_lua_double_new(double d) {
+    uint64_t bits = 0;
+    memcpy(&bits, &d, sizeof(bits));
+    as_bytes * b = as_bytes_new(sizeof(bits));
+    as_bytes_append_int64(b, (int64_t) bits);
+    as_bytes_set_type(b, AS_BYTES_DOUBLE);
+    return (as_val *) b;
+}
+
+/**
+ * Reads a double created by mod_lua_double_new().
+ *
+ * @param v the val to read
+ * @param d receives the value
+ * @returns true if v is a double, otherwise false.
+ */
+bool mod_lua_double_get(const as_val * v, double * d) {
+    as_bytes * b = (as_bytes *) v;
+    int64_t bits = 0;
+    if ( as_val_type(v) != AS_BYTES || as_bytes_get_type(b) != AS_BYTES_DOUBLE ||
+        as_bytes_size(b) != sizeof(bits) || as_bytes_get_int64(b, 0, &bits) != sizeof(bits) ) {
+        return false;
+    }
+    memcpy(d, &bits, sizeof(bits));
+    return true;
+}
+
 as_val * mod_lua_takeval(lua_State * l, int i) {
     return mod_lua_toval(l, i);
 }
@@ -54,18 +255,36 @@ as_val * mod_lua_retval(lua_State * l) {
  * @returns the val if exists, otherwise NULL.
  */
 as_val * mod_lua_toval(lua_State * l, int i) {
+    return toval(l, i, 0);
+}
+
+static as_val * toval(lua_State * l, int i, int depth) {
     switch( lua_type(l, i) ) {
         case LUA_TNUMBER : {
-            return (as_val *) as_integer_new((long) lua_tonumber(l, i));
+            lua_Number n = lua_tonumber(l, i);
+            if ( n >= (lua_Number) INT64_MIN && n < -(lua_Number) INT64_MIN && n == (lua_Number) (int64_t) n ) {
+                return (as_val *) as_integer_new((int64_t) n);
+            }
+            return mod_lua_double_new(n);
         }
         case LUA_TBOOLEAN : {
             return (as_val *) as_boolean_new(lua_toboolean(l, i));
         }
         case LUA_TSTRING : {
-            return (as_val *) as_string_new(strdup(lua_tostring(l, i)), true);
+            size_t len = 0;
+            const char * s = lua_tolstring(l, i, &len);
+            char * c = (char *) malloc(len + 1);
+            memcpy(c, s, len + 1);
+            return (as_val *) as_string_new_wlen(c, len, true);
         }
         case LUA_TUSERDATA : {
             mod_lua_box * box = (mod_lua_box *) lua_touserdata(l, i);
+            if ( box && box->value && as_val_type(box->value) == AS_BYTES ) {
+                // a view is copied out of the bytes it shares before it is stored
+                if ( mod_lua_ownbytes(l, i) == NULL ) {
+                    return NULL;
+                }
+            }
             if ( box && box->value ) {
                 switch( as_val_type(box->value) ) {
                     case AS_BOOLEAN: 
@@ -90,8 +309,10 @@ as_val * mod_lua_toval(lua_State * l, int i) {
                 return (as_val *) NULL;
             }
         }
+        case LUA_TTABLE : {
+            return table_toval(l, i, depth);
+        }
         case LUA_TNIL :
-        case LUA_TTABLE :
         case LUA_TFUNCTION :
         case LUA_TLIGHTUSERDATA :
         default:
@@ -123,10 +344,16 @@ int mod_lua_pushval(lua_State * l, const as_val * v) {
             return 1;
         }
         case AS_STRING: {
-            lua_pushstring(l, as_string_tostring((as_string *) v) );
+            as_string * s = (as_string *) v;
+            lua_pushlstring(l, as_string_tostring(s), as_string_len(s));
             return 1;   
         }
         case AS_BYTES: {
+            double d = 0.0;
+            if ( mod_lua_double_get(v, &d) ) {
+                lua_pushnumber(l, d);
+                return 1;
+            }
             as_val_reserve(v);
             mod_lua_pushbytes(l, (as_bytes *) v);
             return 1;   
@@ -161,6 +388,18 @@ int mod_lua_pushval(lua_State * l, const as_val * v) {
 
 
 
+/**
+ * Pushes a val onto the Lua stack, with lists and maps converted to
+ * Lua tables, for UDFs that read them many times.
+ *
+ * @param l the lua_State to push the val onto
+ * @param v the val to push on to the stack
+ * @returns number of values pushed
+ */
+int mod_lua_pushtable(lua_State * l, const as_val * v) {
+    return pushtable(l, v, 0);
+}
+
 mod_lua_box * mod_lua_newbox(lua_State * l, mod_lua_scope scope, void * value, const char * type) {
     mod_lua_box * box = (mod_lua_box *) lua_newuserdata(l, sizeof(mod_lua_box));
     box->scope = scope;
@@ -171,10 +410,61 @@ mod_lua_box * mod_lua_newbox(lua_State * l, mod_lua_scope scope, void * value, c
 mod_lua_box * mod_lua_pushbox(lua_State * l, mod_lua_scope scope, void * value, const char * type) {
     mod_lua_box * box = (mod_lua_box *) mod_lua_newbox(l, scope, value, type);
     luaL_getmetatable(l, type);
+    if ( scope == MOD_LUA_SCOPE_HOST ) {
+        // Lua never frees a HOST value, so skip the finalizer
+        lua_pushliteral(l, MOD_LUA_REG_HOST_METATABLE);
+        lua_rawget(l, -2);
+        if ( lua_istable(l, -1) ) {
+            lua_remove(l, -2);
+        }
+        else {
+            lua_pop(l, 1);
+        }
+    }
     lua_setmetatable(l, -2);
     return box;
 }
 
+/**
+ * Pushes the box already holding the value, if Lua still has one,
+ * otherwise a new LUA scope box. Either way, the caller's reference
+ * to the value is given to the box, so a reused box releases it.
+ */
+mod_lua_box * mod_lua_sharebox(lua_State * l, as_val * value, const char * type) {
+    lua_pushlightuserdata(l, &sharebox_key);
+    lua_rawget(l, LUA_REGISTRYINDEX);
+
+    if ( lua_istable(l, -1) ) {
+        lua_pushlightuserdata(l, value);
+        lua_rawget(l, -2);
+        mod_lua_box * box = (mod_lua_box *) lua_touserdata(l, -1);
+        if ( box != NULL && box->value == value ) {
+            lua_remove(l, -2);
+            as_val_destroy(value);
+            return box;
+        }
+        lua_pop(l, 1);
+    }
+    else {
+        lua_pop(l, 1);
+        lua_newtable(l);
+        lua_createtable(l, 0, 1);
+        lua_pushliteral(l, "v");
+        lua_setfield(l, -2, "__mode");
+        lua_setmetatable(l, -2);
+        lua_pushlightuserdata(l, &sharebox_key);
+        lua_pushvalue(l, -2);
+        lua_rawset(l, LUA_REGISTRYINDEX);
+    }
+
+    mod_lua_box * box = mod_lua_pushbox(l, MOD_LUA_SCOPE_LUA, value, type);
+    lua_pushlightuserdata(l, value);
+    lua_pushvalue(l, -2);
+    lua_rawset(l, -4);
+    lua_remove(l, -2);
+    return box;
+}
+
 mod_lua_box * mod_lua_tobox(lua_State * l, int index, const char * type) {
     mod_lua_box * box = (mod_lua_box *) lua_touserdata(l, index);
     if (box == NULL && type != NULL ) luaL_typerror(l, index, type);
@@ -183,9 +473,21 @@ mod_lua_box * mod_lua_tobox(lua_State * l, int index, const char * type) {
 
 mod_lua_box * mod_lua_checkbox(lua_State * l, int index, const char * type) {
     luaL_checktype(l, index, LUA_TUSERDATA);
-    mod_lua_box * box = (mod_lua_box *) luaL_checkudata(l, index, type);
-    if (box == NULL) luaL_typerror(l, index, type);
-    return box;
+    mod_lua_box * box = (mod_lua_box *) lua_touserdata(l, index);
+    if ( box != NULL && lua_getmetatable(l, index) ) {
+        luaL_getmetatable(l, type);
+        int match = lua_rawequal(l, -1, -2);
+        if ( !match ) {
+            lua_pushliteral(l, MOD_LUA_REG_HOST_METATABLE);
+            lua_rawget(l, -2);
+            match = lua_rawequal(l, -1, -3);
+            lua_pop(l, 1);
+        }
+        lua_pop(l, 2);
+        if ( match ) return box;
+    }
+    luaL_typerror(l, index, type);
+    return NULL;
 }
 
 int mod_lua_freebox(lua_State * l, int index, const char * type) {
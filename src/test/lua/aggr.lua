@@ -31,6 +31,44 @@ function sum(s)
     return s : reduce(add)
 end
 
+function sumsq(s)
+
+    local function _square(a)
+        return a * a
+    end
+
+    return s : map(_square) : reduce(add)
+end
+
+function sumfail(s, bad)
+
+    local function _check(a)
+        if a == bad then
+            error("bad value")
+        end
+        return a
+    end
+
+    return s : map(_check) : reduce(add)
+end
+
+-- As sumfail, without a reduce, so it is not split across stream workers.
+function mapfail(s, bad)
+
+    local function _check(a)
+        if a == bad then
+            error("bad value")
+        end
+        return a
+    end
+
+    return s : map(_check)
+end
+
+function sumfrom(s, init)
+    return s : aggregate(init, add) : reduce(add)
+end
+
 function product(s)
     return s : reduce(math.product)
 end
@@ -42,7 +80,7 @@ function rollup(s)
     end
 
     local function _reduce(a, b)
-        return map.merge(a, b, math.sum)
+        return map.merge_into(a, b, math.sum)
     end
 
 
@@ -57,4 +95,79 @@ function rollup2(s)
     end
 
     return s : aggregate(map(), _aggregate)
-end
\ No newline at end of file
+end
+function average(s)
+
+    local function _aggregate(a, b)
+        a.sum = a.sum + b
+        a.count = a.count + 1
+        return a
+    end
+
+    local function _average(a)
+        return a.sum / a.count
+    end
+
+    return s : aggregate(map{ sum = 0, count = 0 }, _aggregate) : map(_average)
+end
+
+function ratio(s)
+
+    local function _aggregate(a, b)
+        if b % 3 == 0 then
+            a.hits = a.hits + 1
+        end
+        a.total = a.total + 1
+        return a
+    end
+
+    local function _ratio(a)
+        return a.hits / a.total
+    end
+
+    return s : aggregate(map{ hits = 0, total = 0 }, _aggregate) : map(_ratio)
+end
+
+function first(s, n)
+    return s : limit(n)
+end
+
+function top3(s)
+    return s : topk(3)
+end
+
+function digits(s)
+
+    local function _digit(a)
+        return a % 10
+    end
+
+    return s : map(_digit) : distinct()
+end
+
+-- As digits, but each digit is a view of bytes grown after the view is made.
+function viewdigits(s)
+
+    local function _digit(a)
+        local b = bytes(0)
+        bytes.append_int32(b, a % 10)
+        local v = bytes.view(b, 1, 4)
+        bytes.ensure(b, 4096)
+        return v
+    end
+
+    return s : map(_digit) : distinct()
+end
+
+function cardinality(s)
+    return s : count_distinct()
+end
+
+function groups(s)
+
+    local function _group(a)
+        return a % 10000
+    end
+
+    return s : groupby(_group)
+end
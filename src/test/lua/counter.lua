@@ -0,0 +1,8 @@
+local calls = 0
+
+-- Counts the calls made on the lua_State running it, so a test can
+-- tell whether a state was reused.
+function count(r)
+    calls = calls + 1
+    return calls
+end
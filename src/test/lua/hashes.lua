@@ -0,0 +1,50 @@
+local CRC32 = require('CRC32')
+
+-- The sum of the lset bins of 1..n and 'value1'..'value<n>'
+local function bins(f, n, modulo)
+    local total = 0
+    for i = 1, n do
+        total = total + f(i, modulo) + f('value' .. i, modulo)
+    end
+    return total
+end
+
+local function crc32_lua(v, modulo)
+    return CRC32.Hash(v) % modulo
+end
+
+-- Bins picked with CRC32.Hash(), as lset did
+function lua_bins(r, n, modulo)
+    return bins(crc32_lua, n, modulo)
+end
+
+-- Bins picked with hash.crc32(), for sets without a HashType
+function crc32_bins(r, n, modulo)
+    return bins(hash.crc32, n, modulo)
+end
+
+-- The number of values of 1..n and 'value1'..'value<n>' whose
+-- hash.crc32() bin differs from their CRC32.Hash() bin
+function crc32_mismatches(r, n, modulo)
+    local wrong = 0
+    for i = 1, n do
+        if hash.crc32(i, modulo) ~= crc32_lua(i, modulo) then
+            wrong = wrong + 1
+        end
+        local v = 'value' .. i
+        if hash.crc32(v, modulo) ~= crc32_lua(v, modulo) then
+            wrong = wrong + 1
+        end
+    end
+    return wrong
+end
+
+-- Bins picked with hash.hash64(), for new sets
+function hash64_bins(r, n, modulo)
+    return bins(hash.hash64, n, modulo)
+end
+
+-- The CRC32C check value
+function crc32c_check(r)
+    return hash.crc32c('123456789')
+end
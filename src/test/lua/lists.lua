@@ -128,3 +128,91 @@ function newlist(r,a,b,c)
     info("3 => %s", l[3] or "<nil>")
     return l[2]
 end
+
+-- The position of the first value of l not less than key, and whether it
+-- equals key, by a linear scan
+local function scan(l, key, field)
+    for i = 1, list.size(l) do
+        local v = l[i]
+        if field then v = v[field] end
+        if not (v < key) then
+            return i, v == key
+        end
+    end
+    return list.size(l) + 1, false
+end
+
+-- Checks list.bsearch() against a linear scan of lists of n sorted
+-- numbers, strings and maps. Returns the number of differences.
+function bsearch_check(r, n)
+    local numbers = list()
+    local strings = list()
+    local maps = list()
+    for i = 1, n do
+        list.append(numbers, i * 2)
+        list.append(strings, string.format('k%05d', i * 2))
+        list.append(maps, map{key = i * 2})
+    end
+
+    local differences = 0
+    local function check(l, key, field)
+        local p1, f1 = list.bsearch(l, key, field)
+        local p2, f2 = scan(l, key, field)
+        if p1 ~= p2 or f1 ~= f2 then
+            differences = differences + 1
+        end
+    end
+
+    for k = 0, n * 2 + 1 do
+        check(numbers, k)
+        check(strings, string.format('k%05d', k))
+        check(maps, k, 'key')
+    end
+
+    -- values that can't be compared with the key
+    if list.bsearch(numbers, 'a') ~= nil then
+        differences = differences + 1
+    end
+    if list.bsearch(strings, list.iterator(strings)) ~= nil then
+        differences = differences + 1
+    end
+
+    return differences
+end
+
+-- Builds a sorted list of 1..n with list.insert() at the positions
+-- list.bsearch() finds, then splits, slices and removes from it. Returns
+-- the number of values out of place.
+function insert_check(r, n)
+    local l = list()
+    for i = n, 1, -1 do
+        local v = (i * 7) % n + 1
+        list.insert(l, list.bsearch(l, v), v)
+    end
+
+    local wrong = 0
+    local function expect(l, first, last)
+        if list.size(l) ~= last - first + 1 then
+            wrong = wrong + 1
+            return
+        end
+        for i = first, last do
+            if l[i - first + 1] ~= i then wrong = wrong + 1 end
+        end
+    end
+
+    expect(l, 1, n)
+
+    local half = math.floor(n / 2)
+    expect(list.slice(l, half + 1), half + 1, n)
+
+    local tail = list.split(l, half + 1)
+    expect(l, 1, half)
+    expect(tail, half + 1, n)
+
+    if list.remove(l, 1) ~= 1 then wrong = wrong + 1 end
+    if list.remove(l, 100 * n) ~= nil then wrong = wrong + 1 end
+    expect(l, 2, half)
+
+    return wrong
+end
@@ -99,6 +99,44 @@ function delete_record(r,name)
     end
  end
 
+-- Copy a bin by reference, returning its string, its length, and
+-- whether it equals the copied bin, which == can not tell
+function refbin(r,from,to)
+    local v = record.ref(r,from)
+    r[to] = v
+    return tostring(v) .. #v .. tostring(v:eq(r[from]) and not (v == r[from]))
+end
+
+-- Return the bin values as a table, with their count
+function bintable(r,...)
+    local t = {}
+    for i=1, select('#',...) do
+        t[i] = r[select(i,...)]
+    end
+    return { values = t, count = #t }
+end
+
+-- Return a table whose list has an element that does not convert,
+-- beside one that does
+function holetable(r)
+    return { held = { 1, function() end, 3 }, kept = { 1, 2, 3 } }
+end
+
+-- Sum a list, read as a table
+function tablesum(r)
+    local sum = 0
+    for _, v in ipairs(list.totable(list{1,2,3,4})) do
+        sum = sum + v
+    end
+    return sum
+end
+
+-- Read the same map from a list twice
+function sharedbox(r)
+    local l = list{map{a=1}}
+    return l[1] == l[1]
+end
+
 -- @TODO return record as is
 -- function echo_record(record) 
 --	return record;
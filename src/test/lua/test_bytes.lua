@@ -65,3 +65,82 @@ function lists_of_bytes(r, b)
 
 end
 
+
+-- Packs n 4 byte entries with bytes.append_fixed(), then reads them back
+-- with bytes.split_fixed(), in order and last first. Returns the number
+-- of entries that differ.
+function fixed_check(r, n)
+    local entries = list()
+    local expected = {}
+    for i = 1, n do
+        local e = bytes(4)
+        bytes.append_int32(e, i)
+        list.append(entries, e)
+        expected[i] = tostring(e)
+    end
+
+    local b = bytes(0)
+    local wrong = 0
+    if bytes.append_fixed(b, entries, 4) ~= n then wrong = wrong + 1 end
+    if bytes.size(b) ~= n * 4 then wrong = wrong + 1 end
+
+    local forward = bytes.split_fixed(b, 4)
+    local backward = bytes.split_fixed(b, 4, n, true)
+    local last = bytes.split_fixed(b, 4, 2, true)
+    if list.size(forward) ~= n or list.size(backward) ~= n or list.size(last) ~= 2 then
+        return wrong + 1
+    end
+
+    for i = 1, n do
+        if tostring(forward[i]) ~= expected[i] then wrong = wrong + 1 end
+        if tostring(backward[i]) ~= expected[n + 1 - i] then wrong = wrong + 1 end
+    end
+    if tostring(last[2]) ~= expected[n - 1] then wrong = wrong + 1 end
+
+    return wrong
+end
+
+-- Reads n 4 byte entries through one reused bytes.view(), and checks that
+-- mutating or storing a view leaves the bytes it shares unchanged. Returns
+-- the number of checks that fail.
+function view_check(r, n)
+    local entries = list()
+    for i = 1, n do
+        local e = bytes(4)
+        bytes.append_int32(e, i)
+        list.append(entries, e)
+    end
+
+    local b = bytes(0)
+    bytes.append_fixed(b, entries, 4)
+    local before = tostring(b)
+    local wrong = 0
+
+    local v = nil
+    for i = 1, n do
+        v = bytes.view(b, (i - 1) * 4 + 1, 4, v)
+        if bytes.size(v) ~= 4 or tostring(v) ~= tostring(entries[i]) then
+            wrong = wrong + 1
+        end
+    end
+
+    -- a view of a view is a window of the same bytes
+    local w = bytes.view(bytes.view(b, 5, 8), 5, 4)
+    if tostring(w) ~= tostring(entries[3]) then wrong = wrong + 1 end
+
+    -- the window is cut to the end of the bytes
+    if bytes.size(bytes.view(b, n * 4 - 1, 8)) ~= 2 then wrong = wrong + 1 end
+
+    -- a mutated view is copied first
+    bytes.append_int32(w, 0)
+    if bytes.size(w) ~= 8 or tostring(b) ~= before then wrong = wrong + 1 end
+
+    -- a stored view is copied first
+    local l = list()
+    v = bytes.view(b, 1, 4)
+    list.append(l, v)
+    bytes.view(b, 5, 4, v)
+    if tostring(l[1]) ~= tostring(entries[1]) then wrong = wrong + 1 end
+
+    return wrong
+end
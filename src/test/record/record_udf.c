@@ -4,10 +4,15 @@
 #include <aerospike/as_types.h>
 #include <limits.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 
+#include <aerospike/as_memtracker.h>
 #include <aerospike/as_module.h>
 #include <aerospike/mod_lua.h>
+#include <aerospike/mod_lua_alloc.h>
 #include <aerospike/mod_lua_config.h>
+#include <aerospike/mod_lua_stats.h>
 
 #include "../util/test_aerospike.h"
 #include "../util/test_logger.h"
@@ -69,6 +74,520 @@ TEST( record_udf_2, "concat bins a and b of {a = 'abc', b = 'def' }" ) {
     as_result_destroy(res);
 }
 
+TEST( record_udf_3, "getbin over 10,000 records, single applies vs. batch apply" ) {
+
+    uint32_t n = 10000;
+
+    as_rec **   recs    = (as_rec **) malloc(n * sizeof(as_rec *));
+    as_result * results = (as_result *) malloc(n * sizeof(as_result));
+
+    for ( uint32_t i = 0; i < n; i++ ) {
+        recs[i] = map_rec_new();
+        as_rec_set(recs[i], "a", (as_val *) as_integer_new(i));
+        as_result_init(&results[i]);
+    }
+
+    as_list * arglist = (as_list *) as_arraylist_new(1,0);
+    as_list_append_str(arglist, "a");
+
+    struct timespec t0, t1, t2;
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+
+    for ( uint32_t i = 0; i < n; i++ ) {
+        as_result * res = as_success_new(NULL);
+        int rc = as_module_apply_record(&mod_lua, &as, "records", "getbin", recs[i], arglist, res);
+        assert_int_eq( rc, 0 );
+        assert_true( res->is_success );
+        as_result_destroy(res);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    int rc = mod_lua_apply_record_batch(&mod_lua, &as, "records", "getbin", recs, n, arglist, results);
+
+    clock_gettime(CLOCK_MONOTONIC, &t2);
+
+    assert_int_eq( rc, 0 );
+
+    for ( uint32_t i = 0; i < n; i++ ) {
+        assert_true( results[i].is_success );
+        assert_not_null( results[i].value );
+        assert_int_eq( as_integer_toint((as_integer *) results[i].value), i );
+    }
+
+    long single = (t1.tv_sec - t0.tv_sec) * 1000000 + (t1.tv_nsec - t0.tv_nsec) / 1000;
+    long batch = (t2.tv_sec - t1.tv_sec) * 1000000 + (t2.tv_nsec - t1.tv_nsec) / 1000;
+    info("single applies: %ldus, batch apply: %ldus", single, batch);
+
+    for ( uint32_t i = 0; i < n; i++ ) {
+        as_rec_destroy(recs[i]);
+        as_result_destroy(&results[i]);
+    }
+    free(recs);
+    free(results);
+    as_list_destroy(arglist);
+}
+
+static bool find_stats(const mod_lua_function_stats * stats, void * udata) {
+    mod_lua_function_stats * found = (mod_lua_function_stats *) udata;
+    if ( strcmp(stats->module, "records") == 0 && strcmp(stats->function, "getbin") == 0 ) {
+        memcpy(found, stats, sizeof(mod_lua_function_stats));
+        return false;
+    }
+    return true;
+}
+
+TEST( record_udf_4, "stats count calls to getbin and their phases" ) {
+
+    as_rec * rec = map_rec_new();
+    as_rec_set(rec, "a", (as_val *) as_integer_new(123));
+
+    as_list * arglist = (as_list *) as_arraylist_new(1,0);
+    as_list_append_str(arglist, "a");
+
+    mod_lua_function_stats before = { .calls = 0 };
+    mod_lua_stats_foreach(find_stats, &before);
+
+    for ( int i = 0; i < 10; i++ ) {
+        as_result * res = as_success_new(NULL);
+        int rc = as_module_apply_record(&mod_lua, &as, "records", "getbin", rec, arglist, res);
+        assert_int_eq( rc, 0 );
+        as_result_destroy(res);
+    }
+
+    mod_lua_function_stats after = { .calls = 0 };
+    mod_lua_stats_foreach(find_stats, &after);
+
+    assert_int_eq( after.calls - before.calls, 10 );
+    assert_int_eq( after.errors - before.errors, 0 );
+
+    for ( int p = 0; p < MOD_LUA_STATS_PHASES; p++ ) {
+        uint64_t n = 0;
+        for ( int b = 0; b < MOD_LUA_STATS_BUCKETS; b++ ) {
+            n += after.latency[p][b] - before.latency[p][b];
+        }
+        assert_int_eq( n, 10 );
+    }
+
+    mod_lua_cache_stats cache;
+    mod_lua_stats_cache_get(&cache);
+    assert_true( cache.events[MOD_LUA_STATS_CACHE_CREATE] > 0 );
+    assert_true( cache.memory > 0 );
+
+    as_rec_destroy(rec);
+    as_list_destroy(arglist);
+}
+
+TEST( record_udf_5, "record.ref copies bin a of {a = 'abcdef'} to bin b without a copy" ) {
+
+    as_rec * rec = map_rec_new();
+    as_rec_set(rec, "a", (as_val *) as_string_new("abcdef",false));
+
+    as_list * arglist = (as_list *) as_arraylist_new(2,0);
+    as_list_append_str(arglist, "a");
+    as_list_append_str(arglist, "b");
+
+    as_result * res = as_success_new(NULL);
+
+    int rc = as_module_apply_record(&mod_lua, &as, "records", "refbin", rec, arglist, res);
+
+    assert_int_eq( rc, 0 );
+    assert_true( res->is_success );
+    assert_not_null( res->value );
+    assert_string_eq( as_string_tostring((as_string *) res->value), "abcdef6true" );
+    assert( as_rec_get(rec, "b") == as_rec_get(rec, "a") );
+
+    as_rec_destroy(rec);
+    as_list_destroy(arglist);
+    as_result_destroy(res);
+}
+
+TEST( record_udf_6, "return bins a and b of {a = 1, b = 2} as a table" ) {
+
+    as_rec * rec = map_rec_new();
+    as_rec_set(rec, "a", (as_val *) as_integer_new(1));
+    as_rec_set(rec, "b", (as_val *) as_integer_new(2));
+
+    as_list * arglist = (as_list *) as_arraylist_new(2,0);
+    as_list_append_str(arglist, "a");
+    as_list_append_str(arglist, "b");
+
+    as_result * res = as_success_new(NULL);
+
+    int rc = as_module_apply_record(&mod_lua, &as, "records", "bintable", rec, arglist, res);
+
+    assert_int_eq( rc, 0 );
+    assert_true( res->is_success );
+    assert_not_null( res->value );
+    assert_int_eq( as_val_type(res->value), AS_MAP );
+
+    as_map * map = (as_map *) res->value;
+
+    as_string values;
+    as_string_init(&values, "values", false);
+    as_list * list = (as_list *) as_map_get(map, (as_val *) &values);
+    assert_not_null( list );
+    assert_int_eq( as_val_type((as_val *) list), AS_LIST );
+    assert_int_eq( as_list_size(list), 2 );
+    assert_int_eq( as_integer_toint((as_integer *) as_list_get(list, 1)), 2 );
+
+    as_string count;
+    as_string_init(&count, "count", false);
+    assert_int_eq( as_integer_toint((as_integer *) as_map_get(map, (as_val *) &count)), 2 );
+
+    as_rec_destroy(rec);
+    as_list_destroy(arglist);
+    as_result_destroy(res);
+}
+
+TEST( record_udf_7, "sum a list read as a table" ) {
+
+    as_rec * rec = map_rec_new();
+
+    as_result * res = as_success_new(NULL);
+
+    int rc = as_module_apply_record(&mod_lua, &as, "records", "tablesum", rec, NULL, res);
+
+    assert_int_eq( rc, 0 );
+    assert_true( res->is_success );
+    assert_not_null( res->value );
+    assert_int_eq( as_integer_toint((as_integer *) res->value), 10 );
+
+    as_rec_destroy(rec);
+    as_result_destroy(res);
+}
+
+TEST( record_udf_8, "reading a map from a list twice gives the same box" ) {
+
+    as_rec * rec = map_rec_new();
+
+    as_result * res = as_success_new(NULL);
+
+    int rc = as_module_apply_record(&mod_lua, &as, "records", "sharedbox", rec, NULL, res);
+
+    assert_int_eq( rc, 0 );
+    assert_true( res->is_success );
+    assert_not_null( res->value );
+    assert_true( as_boolean_tobool((as_boolean *) res->value) );
+
+    as_rec_destroy(rec);
+    as_result_destroy(res);
+}
+
+static int64_t apply_bins(const char * function, int64_t n, int64_t modulo, long * us) {
+
+    as_rec * rec = map_rec_new();
+    as_list * arglist = (as_list *) as_arraylist_new(2,0);
+    as_list_append_int64(arglist, n);
+    as_list_append_int64(arglist, modulo);
+
+    as_result * res = as_success_new(NULL);
+
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    int rc = as_module_apply_record(&mod_lua, &as, "hashes", function, rec, arglist, res);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    *us = (t1.tv_sec - t0.tv_sec) * 1000000 + (t1.tv_nsec - t0.tv_nsec) / 1000;
+
+    int64_t total = -1;
+    if ( rc == 0 && res->is_success && res->value ) {
+        total = as_integer_toint((as_integer *) res->value);
+    }
+
+    as_rec_destroy(rec);
+    as_result_destroy(res);
+    as_list_destroy(arglist);
+    return total;
+}
+
+TEST( record_udf_9, "lset bins of 20,000 values with CRC32.Hash, hash.crc32 and hash.hash64" ) {
+
+    int64_t n = 10000;
+    int64_t modulo = 31;
+    long lua_us = 0, crc32_us = 0, hash64_us = 0, check_us = 0;
+
+    int64_t lua_total = apply_bins("lua_bins", n, modulo, &lua_us);
+    int64_t crc32_total = apply_bins("crc32_bins", n, modulo, &crc32_us);
+    int64_t hash64_total = apply_bins("hash64_bins", n, modulo, &hash64_us);
+
+    // hash.crc32 must keep the bin of every value of existing sets
+    assert_true( lua_total > 0 );
+    assert_true( crc32_total > 0 );
+    assert_int_eq( apply_bins("crc32_mismatches", n, modulo, &check_us), 0 );
+    assert_true( hash64_total > 0 );
+    assert_true( hash64_total <= 2 * n * (modulo - 1) );
+
+    info("CRC32.Hash: %ldus, hash.crc32: %ldus, hash.hash64: %ldus", lua_us, crc32_us, hash64_us);
+
+    as_rec * rec = map_rec_new();
+    as_result * res = as_success_new(NULL);
+
+    int rc = as_module_apply_record(&mod_lua, &as, "hashes", "crc32c_check", rec, NULL, res);
+
+    assert_int_eq( rc, 0 );
+    assert_true( res->is_success );
+    assert_not_null( res->value );
+    assert_int_eq( as_integer_toint((as_integer *) res->value), 0xE3069283 );
+
+    as_rec_destroy(rec);
+    as_result_destroy(res);
+}
+
+TEST( record_udf_10, "list.bsearch agrees with a linear scan of 100 sorted values" ) {
+
+    as_rec * rec = map_rec_new();
+
+    as_list * arglist = (as_list *) as_arraylist_new(1,0);
+    as_list_append_int64(arglist, 100);
+
+    as_result * res = as_success_new(NULL);
+
+    int rc = as_module_apply_record(&mod_lua, &as, "lists", "bsearch_check", rec, arglist, res);
+
+    assert_int_eq( rc, 0 );
+    assert_true( res->is_success );
+    assert_not_null( res->value );
+    assert_int_eq( as_integer_toint((as_integer *) res->value), 0 );
+
+    as_rec_destroy(rec);
+    as_result_destroy(res);
+    as_list_destroy(arglist);
+}
+
+TEST( record_udf_11, "list.insert, slice, split and remove of 1,000 values" ) {
+
+    as_rec * rec = map_rec_new();
+
+    as_list * arglist = (as_list *) as_arraylist_new(1,0);
+    as_list_append_int64(arglist, 1000);
+
+    as_result * res = as_success_new(NULL);
+
+    int rc = as_module_apply_record(&mod_lua, &as, "lists", "insert_check", rec, arglist, res);
+
+    assert_int_eq( rc, 0 );
+    assert_true( res->is_success );
+    assert_not_null( res->value );
+    assert_int_eq( as_integer_toint((as_integer *) res->value), 0 );
+
+    as_rec_destroy(rec);
+    as_result_destroy(res);
+    as_list_destroy(arglist);
+}
+
+TEST( record_udf_12, "bytes.append_fixed and bytes.split_fixed of 1,000 entries" ) {
+
+    as_rec * rec = map_rec_new();
+
+    as_list * arglist = (as_list *) as_arraylist_new(1,0);
+    as_list_append_int64(arglist, 1000);
+
+    as_result * res = as_success_new(NULL);
+
+    int rc = as_module_apply_record(&mod_lua, &as, "test_bytes", "fixed_check", rec, arglist, res);
+
+    assert_int_eq( rc, 0 );
+    assert_true( res->is_success );
+    assert_not_null( res->value );
+    assert_int_eq( as_integer_toint((as_integer *) res->value), 0 );
+
+    as_rec_destroy(rec);
+    as_result_destroy(res);
+    as_list_destroy(arglist);
+}
+
+TEST( record_udf_13, "bytes.view reads, mutates and stores windows of bytes" ) {
+
+    as_rec * rec = map_rec_new();
+
+    as_list * arglist = (as_list *) as_arraylist_new(1,0);
+    as_list_append_int64(arglist, 1000);
+
+    as_result * res = as_success_new(NULL);
+
+    int rc = as_module_apply_record(&mod_lua, &as, "test_bytes", "view_check", rec, arglist, res);
+
+    assert_int_eq( rc, 0 );
+    assert_true( res->is_success );
+    assert_not_null( res->value );
+    assert_int_eq( as_integer_toint((as_integer *) res->value), 0 );
+
+    as_rec_destroy(rec);
+    as_result_destroy(res);
+    as_list_destroy(arglist);
+}
+
+static int apply_count(void) {
+
+    as_rec * rec = map_rec_new();
+    as_list * arglist = (as_list *) as_arraylist_new(0,0);
+    as_result * res = as_success_new(NULL);
+
+    int rc = as_module_apply_record(&mod_lua, &as, "counter", "count", rec, arglist, res);
+    int calls = rc == 0 && res->is_success && res->value ? (int) as_integer_toint((as_integer *) res->value) : -1;
+
+    as_rec_destroy(rec);
+    as_result_destroy(res);
+    as_list_destroy(arglist);
+    return calls;
+}
+
+TEST( record_udf_14, "a reloaded module is not served from a stale thread-cached state" ) {
+
+    as_module_event counter = { .type = AS_MODULE_EVENT_FILE_ADD, .data.filename = "counter.lua" };
+    as_module_event records = { .type = AS_MODULE_EVENT_FILE_ADD, .data.filename = "records.lua" };
+
+    // the second call runs on the state the first left in the thread cache
+    int calls = apply_count();
+    assert_true( calls > 0 );
+    assert_int_eq( apply_count(), calls + 1 );
+
+    // reloading another module keeps this module's states
+    assert_int_eq( as_module_update(&mod_lua, &records), 0 );
+    assert_int_eq( apply_count(), calls + 2 );
+
+    // reloading this module discards them
+    assert_int_eq( as_module_update(&mod_lua, &counter), 0 );
+    assert_int_eq( apply_count(), 1 );
+}
+
+/**
+ * A memtracker that grants every reservation until told to refuse them.
+ */
+static bool tracker_refuse = false;
+static int64_t tracker_reserved = 0;
+
+static bool tracker_destroy(as_memtracker * mt) {
+    return true;
+}
+
+static bool tracker_reserve(const as_memtracker * mt, const uint32_t n) {
+    if ( tracker_refuse ) return false;
+    tracker_reserved += n;
+    return true;
+}
+
+static bool tracker_release(const as_memtracker * mt, const uint32_t n) {
+    tracker_reserved -= n;
+    return true;
+}
+
+static bool tracker_reset(const as_memtracker * mt) {
+    return true;
+}
+
+static const as_memtracker_hooks tracker_hooks = {
+    .destroy    = tracker_destroy,
+    .reserve    = tracker_reserve,
+    .release    = tracker_release,
+    .reset      = tracker_reset
+};
+
+#define FILL_MAX 8192
+
+TEST( record_udf_15, "blocks shrink into new slabs when the memtracker refuses them" ) {
+
+    as_memtracker mt;
+    as_memtracker_init(&mt, NULL, &tracker_hooks);
+    tracker_refuse = false;
+    tracker_reserved = 0;
+
+    lua_State * l = mod_lua_alloc_newstate(&mt);
+    assert_not_null( l );
+
+    void * ud = NULL;
+    lua_Alloc f = lua_getallocf(l, &ud);
+
+    void * large = f(ud, NULL, 0, 4096);
+    void * small = f(ud, NULL, 0, 256);
+    assert_not_null( large );
+    assert_not_null( small );
+
+    // take every free 32 byte block, so a shrink to 24 bytes needs a slab
+    tracker_refuse = true;
+    void ** fill = (void **) malloc(FILL_MAX * sizeof(void *));
+    uint32_t n = 0;
+    while ( n < FILL_MAX && (fill[n] = f(ud, NULL, 0, 24)) != NULL ) n++;
+    assert_true( n < FILL_MAX );
+
+    // a large block shrunk to a slab block moves to a slab
+    void * p = f(ud, large, 4096, 24);
+    assert_not_null( p );
+    assert_true( p != large );
+
+    while ( n < FILL_MAX && (fill[n] = f(ud, NULL, 0, 24)) != NULL ) n++;
+    assert_true( n < FILL_MAX );
+
+    // a slab block shrunk to a smaller class moves to that class
+    void * q = f(ud, small, 256, 24);
+    assert_not_null( q );
+    assert_true( q != small );
+
+    f(ud, p, 24, 0);
+    f(ud, q, 24, 0);
+    for ( uint32_t i = 0; i < n; i++ ) {
+        f(ud, fill[i], 24, 0);
+    }
+    free(fill);
+
+    tracker_refuse = false;
+    mod_lua_alloc_close(l);
+
+    // the slabs made for the shrinks were never reserved, nor released
+    assert_int_eq( tracker_reserved, 0 );
+}
+
+TEST( record_udf_16, "a list with an element that does not convert is not shifted" ) {
+
+    as_rec * rec = map_rec_new();
+
+    as_result * res = as_success_new(NULL);
+
+    int rc = as_module_apply_record(&mod_lua, &as, "records", "holetable", rec, NULL, res);
+
+    assert_int_eq( rc, 0 );
+    assert_true( res->is_success );
+    assert_not_null( res->value );
+    assert_int_eq( as_val_type(res->value), AS_MAP );
+
+    as_map * map = (as_map *) res->value;
+
+    // {1, f, 3} does not convert, rather than become [1, 3]
+    as_string held;
+    as_string_init(&held, "held", false);
+    assert_null( as_map_get(map, (as_val *) &held) );
+
+    as_string kept;
+    as_string_init(&kept, "kept", false);
+    as_list * list = (as_list *) as_map_get(map, (as_val *) &kept);
+    assert_not_null( list );
+    assert_int_eq( as_list_size(list), 3 );
+    assert_int_eq( as_integer_toint((as_integer *) as_list_get(list, 2)), 3 );
+
+    as_rec_destroy(rec);
+    as_result_destroy(res);
+}
+
+TEST( record_udf_17, "a function that can not be sandboxed fails on every apply" ) {
+
+    as_rec * rec = map_rec_new();
+
+    // the second apply must not reuse the function unsandboxed
+    for ( int i = 0; i < 2; i++ ) {
+        as_result * res = as_success_new(NULL);
+
+        int rc = as_module_apply_record(&mod_lua, &as, "sandbox", "get", rec, NULL, res);
+
+        assert_int_eq( rc, 0 );
+        assert_false( res->is_success );
+
+        as_result_destroy(res);
+    }
+
+    as_rec_destroy(rec);
+}
+
 /******************************************************************************
  * TEST SUITE
  *****************************************************************************/
@@ -80,6 +599,8 @@ static bool before(atf_suite * suite) {
     mod_lua_config config = {
         .server_mode    = true,
         .cache_enabled  = true,
+        .thread_cache_enabled = true,
+        .stats_enabled  = true,
         .system_path    = "src/lua",
         .user_path      = "src/test/lua"
     };
@@ -108,4 +629,19 @@ SUITE( record_udf, "stream udf tests" ) {
     
     suite_add( record_udf_1 );
     suite_add( record_udf_2 );
+    suite_add( record_udf_3 );
+    suite_add( record_udf_4 );
+    suite_add( record_udf_5 );
+    suite_add( record_udf_6 );
+    suite_add( record_udf_7 );
+    suite_add( record_udf_8 );
+    suite_add( record_udf_9 );
+    suite_add( record_udf_10 );
+    suite_add( record_udf_11 );
+    suite_add( record_udf_12 );
+    suite_add( record_udf_13 );
+    suite_add( record_udf_14 );
+    suite_add( record_udf_15 );
+    suite_add( record_udf_16 );
+    suite_add( record_udf_17 );
 }
\ No newline at end of file
@@ -4,10 +4,13 @@
 #include <aerospike/as_types.h>
 #include <limits.h>
 #include <stdlib.h>
+#include <time.h>
 
 #include <aerospike/as_module.h>
 #include <aerospike/mod_lua.h>
 #include <aerospike/mod_lua_config.h>
+#include <aerospike/mod_lua_stream.h>
+#include <aerospike/mod_lua_val.h>
 
 
 #include "../util/test_aerospike.h"
@@ -272,6 +275,512 @@ TEST( stream_udf_6, "campaign rollup w/ aggregate" ) {
     as_stream_destroy(ostream);
 }
 
+TEST( stream_udf_7, "average range (1-1,000,000)" ) {
+
+    uint32_t limit = 1000*1000;
+    uint32_t produced = 0;
+    uint32_t consumed = 0;
+
+    as_val * result = NULL;
+    double average = 0.0;
+
+    as_val * produce() {
+        if ( produced >= limit ) return AS_STREAM_END;
+        produced++;
+        return (as_val *) as_integer_new(produced);
+    }
+
+    as_stream_status consume(as_val * v) {
+        if ( v != AS_STREAM_END ) consumed++;
+        result = v;
+        return AS_STREAM_OK;
+    }
+
+    as_stream * istream = producer_stream_new(produce);
+    as_stream * ostream = consumer_stream_new(consume);
+    as_list *   arglist = NULL;
+
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    int rc = as_module_apply_stream(&mod_lua, &as, "aggr", "average", istream, arglist, ostream);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    info("average: %ldus", (t1.tv_sec - t0.tv_sec) * 1000000 + (t1.tv_nsec - t0.tv_nsec) / 1000);
+
+    assert_int_eq( rc, 0);
+    assert_int_eq( produced, limit);
+    assert_int_eq( consumed, 1);
+    assert_true( mod_lua_double_get(result, &average) );
+    assert_true( average == 500000.5 );
+
+    as_val_destroy(result);
+    as_stream_destroy(istream);
+    as_stream_destroy(ostream);
+}
+
+TEST( stream_udf_8, "ratio of multiples of 3 in range (1-1,000,000)" ) {
+
+    uint32_t limit = 1000*1000;
+    uint32_t produced = 0;
+    uint32_t consumed = 0;
+
+    as_val * result = NULL;
+    double ratio = 0.0;
+
+    as_val * produce() {
+        if ( produced >= limit ) return AS_STREAM_END;
+        produced++;
+        return (as_val *) as_integer_new(produced);
+    }
+
+    as_stream_status consume(as_val * v) {
+        if ( v != AS_STREAM_END ) consumed++;
+        result = v;
+        return AS_STREAM_OK;
+    }
+
+    as_stream * istream = producer_stream_new(produce);
+    as_stream * ostream = consumer_stream_new(consume);
+    as_list *   arglist = NULL;
+
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    int rc = as_module_apply_stream(&mod_lua, &as, "aggr", "ratio", istream, arglist, ostream);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    info("ratio: %ldus", (t1.tv_sec - t0.tv_sec) * 1000000 + (t1.tv_nsec - t0.tv_nsec) / 1000);
+
+    assert_int_eq( rc, 0);
+    assert_int_eq( produced, limit);
+    assert_int_eq( consumed, 1);
+    assert_true( mod_lua_double_get(result, &ratio) );
+    assert_true( ratio == 333333.0 / 1000000.0 );
+
+    as_val_destroy(result);
+    as_stream_destroy(istream);
+    as_stream_destroy(ostream);
+}
+
+TEST( stream_udf_9, "sum of squares range (1-100,000) across stream workers" ) {
+
+    uint32_t limit = 100*1000;
+    uint32_t produced = 0;
+    uint32_t consumed = 0;
+
+    as_integer * result = NULL;
+
+    as_val * produce() {
+        if ( produced >= limit ) return AS_STREAM_END;
+        produced++;
+        return (as_val *) as_integer_new(produced);
+    }
+
+    as_stream_status consume(as_val * v) {
+        if ( v != AS_STREAM_END ) consumed++;
+        result = (as_integer *) v;
+        return AS_STREAM_OK;
+    }
+
+    as_stream * istream = producer_stream_new(produce);
+    as_stream * ostream = consumer_stream_new(consume);
+    as_list *   arglist = NULL;
+
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    int rc = as_module_apply_stream(&mod_lua, &as, "aggr", "sumsq", istream, arglist, ostream);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    info("sumsq: %ldus", (t1.tv_sec - t0.tv_sec) * 1000000 + (t1.tv_nsec - t0.tv_nsec) / 1000);
+
+    assert_int_eq( rc, 0);
+    assert_int_eq( produced, limit);
+    assert_int_eq( consumed, 1);
+    assert_int_eq( as_integer_toint(result), 333338333350000);
+
+    as_integer_destroy(result);
+    as_stream_destroy(istream);
+    as_stream_destroy(ostream);
+}
+
+TEST( stream_udf_10, "limit range (1-1,000,000) to 5" ) {
+
+    uint32_t limit = 1000*1000;
+    uint32_t produced = 0;
+    uint32_t consumed = 0;
+
+    as_val * produce() {
+        if ( produced >= limit ) return AS_STREAM_END;
+        produced++;
+        return (as_val *) as_integer_new(produced);
+    }
+
+    as_stream_status consume(as_val * v) {
+        if ( v != AS_STREAM_END ) consumed++;
+        as_val_destroy(v);
+        return AS_STREAM_OK;
+    }
+
+    as_stream * istream = producer_stream_new(produce);
+    as_stream * ostream = consumer_stream_new(consume);
+    as_list *   arglist = (as_list *) as_arraylist_new(1,0);
+    as_list_append_int64(arglist, 5);
+
+    int rc = as_module_apply_stream(&mod_lua, &as, "aggr", "first", istream, arglist, ostream);
+
+    // the input is no longer read once the limit is reached
+    assert_int_eq( rc, 0);
+    assert_int_eq( produced, 5);
+    assert_int_eq( consumed, 5);
+
+    as_list_destroy(arglist);
+    as_stream_destroy(istream);
+    as_stream_destroy(ostream);
+}
+
+TEST( stream_udf_11, "top 3 of range (1-100,000)" ) {
+
+    uint32_t limit = 100*1000;
+    uint32_t produced = 0;
+    uint32_t consumed = 0;
+
+    int64_t top[3] = { 0 };
+
+    as_val * produce() {
+        if ( produced >= limit ) return AS_STREAM_END;
+        produced++;
+        return (as_val *) as_integer_new(produced);
+    }
+
+    as_stream_status consume(as_val * v) {
+        if ( v != AS_STREAM_END ) {
+            if ( consumed < 3 ) top[consumed] = as_integer_toint((as_integer *) v);
+            consumed++;
+        }
+        as_val_destroy(v);
+        return AS_STREAM_OK;
+    }
+
+    as_stream * istream = producer_stream_new(produce);
+    as_stream * ostream = consumer_stream_new(consume);
+    as_list *   arglist = NULL;
+
+    int rc = as_module_apply_stream(&mod_lua, &as, "aggr", "top3", istream, arglist, ostream);
+
+    assert_int_eq( rc, 0);
+    assert_int_eq( produced, limit);
+    assert_int_eq( consumed, 3);
+    assert_int_eq( top[0], 100000);
+    assert_int_eq( top[1], 99999);
+    assert_int_eq( top[2], 99998);
+
+    as_stream_destroy(istream);
+    as_stream_destroy(ostream);
+}
+
+TEST( stream_udf_12, "distinct last digits of range (1-100,000)" ) {
+
+    uint32_t limit = 100*1000;
+    uint32_t produced = 0;
+    uint32_t consumed = 0;
+
+    as_val * produce() {
+        if ( produced >= limit ) return AS_STREAM_END;
+        produced++;
+        return (as_val *) as_integer_new(produced);
+    }
+
+    as_stream_status consume(as_val * v) {
+        if ( v != AS_STREAM_END ) consumed++;
+        as_val_destroy(v);
+        return AS_STREAM_OK;
+    }
+
+    as_stream * istream = producer_stream_new(produce);
+    as_stream * ostream = consumer_stream_new(consume);
+    as_list *   arglist = NULL;
+
+    int rc = as_module_apply_stream(&mod_lua, &as, "aggr", "digits", istream, arglist, ostream);
+
+    assert_int_eq( rc, 0);
+    assert_int_eq( produced, limit);
+    assert_int_eq( consumed, 10);
+
+    as_stream_destroy(istream);
+    as_stream_destroy(ostream);
+}
+
+TEST( stream_udf_13, "count distinct sketch of range (1-100,000)" ) {
+
+    uint32_t limit = 100*1000;
+    uint32_t produced = 0;
+    uint32_t consumed = 0;
+
+    as_val * result = NULL;
+
+    as_val * produce() {
+        if ( produced >= limit ) return AS_STREAM_END;
+        produced++;
+        return (as_val *) as_integer_new(produced);
+    }
+
+    as_stream_status consume(as_val * v) {
+        if ( v != AS_STREAM_END ) consumed++;
+        result = v;
+        return AS_STREAM_OK;
+    }
+
+    as_stream * istream = producer_stream_new(produce);
+    as_stream * ostream = consumer_stream_new(consume);
+    as_list *   arglist = NULL;
+
+    int rc = as_module_apply_stream(&mod_lua, &as, "aggr", "cardinality", istream, arglist, ostream);
+
+    // in server mode, the sketch is sent for the client to merge
+    assert_int_eq( rc, 0);
+    assert_int_eq( produced, limit);
+    assert_int_eq( consumed, 1);
+    assert_int_eq( as_val_type(result), AS_BYTES);
+    assert_int_eq( as_bytes_size((as_bytes *) result), 4096);
+
+    as_val_destroy(result);
+    as_stream_destroy(istream);
+    as_stream_destroy(ostream);
+}
+
+TEST( stream_udf_14, "groupby range (1-1,000,000) into 10,000 groups" ) {
+
+    uint32_t limit = 1000*1000;
+    uint32_t produced = 0;
+    uint32_t consumed = 0;
+
+    as_map * result = NULL;
+
+    as_val * produce() {
+        if ( produced >= limit ) return AS_STREAM_END;
+        produced++;
+        return (as_val *) as_integer_new(produced);
+    }
+
+    as_stream_status consume(as_val * v) {
+        if ( v != AS_STREAM_END ) consumed++;
+        result = (as_map *) v;
+        return AS_STREAM_OK;
+    }
+
+    as_stream * istream = producer_stream_new(produce);
+    as_stream * ostream = consumer_stream_new(consume);
+    as_list *   arglist = NULL;
+
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    int rc = as_module_apply_stream(&mod_lua, &as, "aggr", "groups", istream, arglist, ostream);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    info("groupby: %ldus", (t1.tv_sec - t0.tv_sec) * 1000000 + (t1.tv_nsec - t0.tv_nsec) / 1000);
+
+    assert_int_eq( rc, 0);
+    assert_int_eq( produced, limit);
+    assert_int_eq( consumed, 1);
+    assert_int_eq( as_map_size(result), 10000);
+
+    as_integer i;
+    assert_int_eq( as_list_size((as_list *) as_map_get(result, (as_val *) as_integer_init(&i, 0))), 100);
+    assert_int_eq( as_list_size((as_list *) as_map_get(result, (as_val *) as_integer_init(&i, 9999))), 100);
+
+    as_map_destroy(result);
+    as_stream_destroy(istream);
+    as_stream_destroy(ostream);
+}
+
+TEST( stream_udf_15, "groupby range (1-1,000,000) flushed in partial results" ) {
+
+    uint32_t limit = 1000*1000;
+    uint32_t produced = 0;
+    uint32_t consumed = 0;
+    uint32_t grouped = 0;
+
+    as_val * produce() {
+        if ( produced >= limit ) return AS_STREAM_END;
+        produced++;
+        return (as_val *) as_integer_new(produced);
+    }
+
+    bool count(const as_val * k, const as_val * v, void * udata) {
+        grouped += as_list_size((as_list *) v);
+        return true;
+    }
+
+    as_stream_status consume(as_val * v) {
+        if ( v != AS_STREAM_END ) {
+            consumed++;
+            as_map_foreach((as_map *) v, count, NULL);
+        }
+        as_val_destroy(v);
+        return AS_STREAM_OK;
+    }
+
+    as_stream * istream = producer_stream_new(produce);
+    as_stream * ostream = consumer_stream_new(consume);
+    as_list *   arglist = NULL;
+
+    mod_lua_stream_flush_bytes(1024 * 1024);
+    int rc = as_module_apply_stream(&mod_lua, &as, "aggr", "groups", istream, arglist, ostream);
+    mod_lua_stream_flush_bytes(0);
+
+    // the client merges the partial results
+    assert_int_eq( rc, 0);
+    assert_int_eq( produced, limit);
+    assert_true( consumed > 1 );
+    assert_int_eq( grouped, limit);
+
+    as_stream_destroy(istream);
+    as_stream_destroy(ostream);
+}
+
+TEST( stream_udf_16, "an error on a stream worker fails the apply" ) {
+
+    uint32_t limit = 100*1000;
+    uint32_t produced = 0;
+    uint32_t consumed = 0;
+
+    as_val * produce() {
+        if ( produced >= limit ) return AS_STREAM_END;
+        produced++;
+        return (as_val *) as_integer_new(produced);
+    }
+
+    as_stream_status consume(as_val * v) {
+        if ( v != AS_STREAM_END ) consumed++;
+        as_val_destroy(v);
+        return AS_STREAM_OK;
+    }
+
+    as_stream * istream = producer_stream_new(produce);
+    as_stream * ostream = consumer_stream_new(consume);
+    as_list *   arglist = (as_list *) as_arraylist_new(1,0);
+    as_list_append_int64(arglist, limit / 2);
+
+    int rc = as_module_apply_stream(&mod_lua, &as, "aggr", "sumfail", istream, arglist, ostream);
+
+    assert_true( rc != 0 );
+    assert_int_eq( consumed, 0);
+
+    as_list_destroy(arglist);
+    as_stream_destroy(istream);
+    as_stream_destroy(ostream);
+}
+
+TEST( stream_udf_17, "sum from 100 of ranges (1-0) and (1-10) across stream workers" ) {
+
+    uint32_t limit = 0;
+    uint32_t produced = 0;
+    uint32_t consumed = 0;
+
+    as_integer * result = NULL;
+
+    as_val * produce() {
+        if ( produced >= limit ) return AS_STREAM_END;
+        produced++;
+        return (as_val *) as_integer_new(produced);
+    }
+
+    as_stream_status consume(as_val * v) {
+        if ( v != AS_STREAM_END ) consumed++;
+        result = (as_integer *) v;
+        return AS_STREAM_OK;
+    }
+
+    as_list * arglist = (as_list *) as_arraylist_new(1,0);
+    as_list_append_int64(arglist, 100);
+
+    // fewer values than a worker reads at once, so the other workers read
+    // none, and the initial value is only added once, as on one state
+    for ( limit = 0; limit <= 10; limit += 10 ) {
+        produced = 0;
+        consumed = 0;
+
+        as_stream * istream = producer_stream_new(produce);
+        as_stream * ostream = consumer_stream_new(consume);
+
+        int rc = as_module_apply_stream(&mod_lua, &as, "aggr", "sumfrom", istream, arglist, ostream);
+
+        assert_int_eq( rc, 0);
+        assert_int_eq( produced, limit);
+        assert_int_eq( consumed, 1);
+        assert_int_eq( as_integer_toint(result), 100 + limit * (limit + 1) / 2);
+
+        as_integer_destroy(result);
+        as_stream_destroy(istream);
+        as_stream_destroy(ostream);
+    }
+
+    as_list_destroy(arglist);
+}
+
+TEST( stream_udf_18, "distinct last digits of range (1-100,000) as views of resized bytes" ) {
+
+    uint32_t limit = 100*1000;
+    uint32_t produced = 0;
+    uint32_t consumed = 0;
+
+    as_val * produce() {
+        if ( produced >= limit ) return AS_STREAM_END;
+        produced++;
+        return (as_val *) as_integer_new(produced);
+    }
+
+    as_stream_status consume(as_val * v) {
+        if ( v != AS_STREAM_END ) consumed++;
+        as_val_destroy(v);
+        return AS_STREAM_OK;
+    }
+
+    as_stream * istream = producer_stream_new(produce);
+    as_stream * ostream = consumer_stream_new(consume);
+    as_list *   arglist = NULL;
+
+    int rc = as_module_apply_stream(&mod_lua, &as, "aggr", "viewdigits", istream, arglist, ostream);
+
+    assert_int_eq( rc, 0);
+    assert_int_eq( produced, limit);
+    assert_int_eq( consumed, 10);
+
+    as_stream_destroy(istream);
+    as_stream_destroy(ostream);
+}
+
+TEST( stream_udf_19, "an error on a stream that is not split fails the apply" ) {
+
+    uint32_t limit = 1000;
+    uint32_t produced = 0;
+    uint32_t consumed = 0;
+
+    as_val * produce() {
+        if ( produced >= limit ) return AS_STREAM_END;
+        produced++;
+        return (as_val *) as_integer_new(produced);
+    }
+
+    as_stream_status consume(as_val * v) {
+        if ( v != AS_STREAM_END ) consumed++;
+        as_val_destroy(v);
+        return AS_STREAM_OK;
+    }
+
+    as_stream * istream = producer_stream_new(produce);
+    as_stream * ostream = consumer_stream_new(consume);
+    as_list *   arglist = (as_list *) as_arraylist_new(1,0);
+    as_list_append_int64(arglist, limit / 2);
+
+    int rc = as_module_apply_stream(&mod_lua, &as, "aggr", "mapfail", istream, arglist, ostream);
+
+    assert_true( rc != 0 );
+
+    as_list_destroy(arglist);
+    as_stream_destroy(istream);
+    as_stream_destroy(ostream);
+}
+
 /******************************************************************************
  * TEST SUITE
  *****************************************************************************/
@@ -284,6 +793,7 @@ static bool before(atf_suite * suite) {
     mod_lua_config config = {
         .server_mode    = true,
         .cache_enabled  = true,
+        .stream_workers = 4,
         .system_path    = "src/lua",
         .user_path      = "src/test/lua"
     };
@@ -316,4 +826,17 @@ SUITE( stream_udf, "stream udf tests" ) {
     suite_add( stream_udf_4 );
     suite_add( stream_udf_5 );
     suite_add( stream_udf_6 );
+    suite_add( stream_udf_7 );
+    suite_add( stream_udf_8 );
+    suite_add( stream_udf_9 );
+    suite_add( stream_udf_10 );
+    suite_add( stream_udf_11 );
+    suite_add( stream_udf_12 );
+    suite_add( stream_udf_13 );
+    suite_add( stream_udf_14 );
+    suite_add( stream_udf_15 );
+    suite_add( stream_udf_16 );
+    suite_add( stream_udf_17 );
+    suite_add( stream_udf_18 );
+    suite_add( stream_udf_19 );
 }
\ No newline at end of file